@@ -1,41 +1,468 @@
 
+#if defined __linux__
+#define	_GNU_SOURCE	/* splice, copy_file_range */
+#endif
+
+#include <assert.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#if defined __linux__
+#include <sys/sendfile.h>
+#endif
+
+
+static struct {
+	char *exename,
+	     *usage_str;
+	int opt_b,	/* number non-blank lines */
+	    opt_n,	/* number lines */
+	    opt_s,	/* squeeze adjacent blank lines */
+	    opt_v;	/* show non-printing characters */
+	int out_pipe,	/* stdout is a pipe: splice */
+	    out_reg;	/* stdout is a regular file: copy_file_range/sendfile */
+	char *buf;	/* page aligned CAT_BUFSIZ bytes */
+
+	/* -bnsv: output buffer, and line state carried across blocks and files */
+	char *obuf;
+	size_t olen;
+	int out_err;		/* a write failed, errno is kept */
+	unsigned long lineno;
+	int mid_line,		/* last output didn't end a line */
+	    blank;		/* last line output was blank */
+} _g;
+
+#define	CAT_BUFSIZ	(128*1024)
+#define	OUT_BUFSIZ	(128*1024)
+/* largest single kernel side copy */
+#define	COPY_CHUNK	(1024*1024*1024)
+
+/* copy_*() results */
+enum { COPY_EOF, COPY_FALLBACK, COPY_RERR, COPY_WERR };
+
+/*
+ *  With several operands, a prefetch thread opens up to PREFETCH_DEPTH
+ *  operands ahead of the one being output and has the kernel start reading
+ *  them in (posix_fadvise WILLNEED), so that the latency of opening and
+ *  reading cold files overlaps with the output of the previous ones.
+ */
+#define	PREFETCH_DEPTH	8
+
+struct operand {
+	char *name;
+	int fd,		/* -1 if open failed */
+	    err;	/* errno of the failed open */
+};
+
+static struct {
+	struct operand *ops;
+	int nops,
+	    nready,	/* # of operands opened by the prefetch thread */
+	    ncur;	/* operand being output */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} _pf;
+
+
+static int usage(char *msg, ...)
+{
+	if (msg) {
+		va_list ap;
+		va_start(ap, msg);
+		fprintf(stderr, "%s: ", _g.exename);
+		vfprintf(stderr, msg, ap);
+		va_end(ap);
+	}
+	fprintf(stderr, "Usage: %s %s\n", _g.exename, _g.usage_str);
+	return EXIT_FAILURE;
+}
+
+/* wait for FD to become ready for EVENTS, after an EAGAIN */
+static void wait_fd(int fd, short events)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = events;
+	while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+		;
+}
+
+/* write(2) all of BUF to stdout, retrying short and interrupted writes */
+static int write_all(const char *buf, size_t len)
+{
+	ssize_t n;
+	while (len > 0) {
+		if ((n = write(STDOUT_FILENO, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				wait_fd(STDOUT_FILENO, POLLOUT);
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* read(2) a block of FD into the buffer, retrying interrupted reads */
+static ssize_t read_block(int fd)
+{
+	ssize_t n;
+	while ((n = read(fd, _g.buf, CAT_BUFSIZ)) == -1) {
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			break;
+		wait_fd(fd, POLLIN);
+	}
+	return n;
+}
+
+/* the read/write loop, works on anything */
+static int copy_rw(int fd)
+{
+	ssize_t n;
+	while ((n = read_block(fd)) > 0)
+		if (write_all(_g.buf, n) == -1)
+			return COPY_WERR;
+	return n == 0 ? COPY_EOF : COPY_RERR;
+}
+
+static void out_flush(void)
+{
+	if (!_g.out_err && write_all(_g.obuf, _g.olen) == -1)
+		_g.out_err = errno;
+	_g.olen = 0;
+}
+
+static void out_write(const char *p, size_t len)
+{
+	if (_g.olen + len > OUT_BUFSIZ) {
+		out_flush();
+		if (len >= OUT_BUFSIZ) {
+			if (!_g.out_err && write_all(p, len) == -1)
+				_g.out_err = errno;
+			return;
+		}
+	}
+	memcpy(_g.obuf+_g.olen, p, len);
+	_g.olen += len;
+}
+
+/* "%6lu\t" */
+static void out_lineno(void)
+{
+	char buf[32], *p = buf+sizeof(buf);
+	unsigned long n = ++_g.lineno;
+	*--p = '\t';
+	do
+		*--p = '0' + n % 10;
+	while ((n /= 10) > 0);
+	while (p > buf+sizeof(buf)-7)
+		*--p = ' ';
+	out_write(p, buf+sizeof(buf)-p);
+}
 
+/* word-at-a-time: nonzero if a byte of W may be below ' ' or above '~' */
+#define	ONES		((unsigned long)-1 / 0xff)
+#define	HIGHS		(ONES * 0x80)
+#define	MAYBE_CTRL(w)	((((w) - ONES*' ') & ~(w) | (w) | (w) + ONES) & HIGHS)
+
+/* -v: control characters as ^X, DEL as ^?, with M- for the high bit */
+static void out_visible(const char *p, const char *end)
+{
+	const char *run = p;
+	unsigned long w;
+	char esc[4];
+	int c, n;
+
+	while (p < end) {
+		if ((size_t)(end - p) >= sizeof(w)) {
+			memcpy(&w, p, sizeof(w));
+			if (!MAYBE_CTRL(w)) {
+				p += sizeof(w);
+				continue;
+			}
+		}
+		if ((c = (unsigned char)*p) >= ' ' && c < 0x7f || c == '\t') {
+			p++;
+			continue;
+		}
+		out_write(run, p - run);
+		n = 0;
+		if (c >= 0x80) {
+			esc[n++] = 'M';
+			esc[n++] = '-';
+			c -= 0x80;
+		}
+		if (c < ' ' || c == 0x7f) {
+			esc[n++] = '^';
+			esc[n++] = c == 0x7f ? '?' : c + '@';
+		} else
+			esc[n++] = c;
+		out_write(esc, n);
+		run = ++p;
+	}
+	out_write(run, p - run);
+}
+
+/**
+ *  -bnsv: FD is read in blocks, split at newlines with memchr(3), and the
+ *  lines go to the output buffer, numbered, squeezed and escaped.  The
+ *  state of the last line output carries over to the next file */
+static int cat_filter(int fd)
+{
+	const char *p, *end, *nl;
+	ssize_t n;
+
+	while ((n = read_block(fd)) > 0) {
+		for (p = _g.buf, end = p + n; p < end; p = nl ? nl+1 : end) {
+			if (!_g.mid_line) {
+				if (*p == '\n') {
+					nl = p;
+					if (_g.opt_s && _g.blank)
+						continue;
+					_g.blank = 1;
+					if (_g.opt_n && !_g.opt_b)
+						out_lineno();
+					out_write("\n", 1);
+					continue;
+				}
+				_g.blank = 0;
+				if (_g.opt_n || _g.opt_b)
+					out_lineno();
+			}
+			nl = memchr(p, '\n', end - p);
+			if (_g.opt_v)
+				out_visible(p, nl ? nl : end);
+			else
+				out_write(p, (nl ? nl : end) - p);
+			if ((_g.mid_line = nl == NULL) == 0)
+				out_write("\n", 1);
+		}
+		if (_g.out_err) {
+			errno = _g.out_err;
+			return COPY_WERR;
+		}
+	}
+	return n == 0 ? COPY_EOF : COPY_RERR;
+}
+
+#if defined __linux__
+/* whether a failed kernel side copy is to be blamed on the output */
+static int copy_err(void)
+{
+	return errno == EPIPE || errno == ENOSPC || errno == EDQUOT || errno == EFBIG ? COPY_WERR : COPY_RERR;
+}
+
+/*
+ *  Kernel side copies, they leave the offset of FD past what was copied so
+ *  COPY_FALLBACK (this pair of files isn't supported, or would block)
+ *  has the next method carry on from there.
+ */
+static int copy_splice(int fd)
+{
+	ssize_t n;
+	while ((n = splice(fd, NULL, STDOUT_FILENO, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) != 0)
+		if (n == -1 && errno != EINTR)
+			return errno == EINVAL || errno == ENOSYS || errno == EAGAIN ? COPY_FALLBACK : copy_err();
+	return COPY_EOF;
+}
+
+static int copy_range(int fd)
+{
+	ssize_t n;
+	while ((n = copy_file_range(fd, NULL, STDOUT_FILENO, NULL, COPY_CHUNK, 0)) != 0)
+		if (n == -1 && errno != EINTR)
+			return errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP
+				|| errno == EBADF ? COPY_FALLBACK : copy_err();
+	return COPY_EOF;
+}
+
+static int copy_sendfile(int fd)
+{
+	ssize_t n;
+	while ((n = sendfile(STDOUT_FILENO, fd, NULL, COPY_CHUNK)) != 0)
+		if (n == -1 && errno != EINTR)
+			return errno == EINVAL || errno == ENOSYS || errno == EAGAIN ? COPY_FALLBACK : copy_err();
+	return COPY_EOF;
+}
+#endif
+
+/**
+ *  Copies FD to stdout by the fastest means the pair of files allows:
+ *  splice(2) if either is a pipe, copy_file_range(2) then sendfile(2) from
+ *  a regular file to a regular file, and the read/write loop otherwise */
+static int cat_fd(int fd)
+{
+#if defined __linux__
+	struct stat st;
+	int rc;
+#endif
+
+	if (_g.obuf != NULL)
+		return cat_filter(fd);
+#if defined __linux__
+	if (fstat(fd, &st) == -1)
+		return copy_rw(fd);
+	if ((_g.out_pipe || S_ISFIFO(st.st_mode)) && (rc = copy_splice(fd)) != COPY_FALLBACK)
+		return rc;
+	if (_g.out_reg && S_ISREG(st.st_mode)) {
+		if ((rc = copy_range(fd)) != COPY_FALLBACK)
+			return rc;
+		if ((rc = copy_sendfile(fd)) != COPY_FALLBACK)
+			return rc;
+	}
+#endif
+	return copy_rw(fd);
+}
+
+static void open_operand(struct operand *op)
+{
+	if (strcmp(op->name, "-") == 0)
+		op->fd = STDIN_FILENO;
+	else if ((op->fd = open(op->name, O_RDONLY)) == -1)
+		op->err = errno;
+	else
+		posix_fadvise(op->fd, 0, 0, POSIX_FADV_WILLNEED);
+}
+
+static void *prefetch(void *arg)
+{
+	int i;
+
+	(void)arg;
+	for (i = 0; i < _pf.nops; i++) {
+		pthread_mutex_lock(&_pf.lock);
+		while (i - _pf.ncur > PREFETCH_DEPTH)
+			pthread_cond_wait(&_pf.cond, &_pf.lock);
+		pthread_mutex_unlock(&_pf.lock);
+
+		open_operand(&_pf.ops[i]);
+
+		pthread_mutex_lock(&_pf.lock);
+		_pf.nready = i+1;
+		pthread_cond_broadcast(&_pf.cond);
+		pthread_mutex_unlock(&_pf.lock);
+	}
+	return NULL;
+}
+
+/* operand I, once opened by the prefetch thread */
+static struct operand *next_operand(int i)
+{
+	pthread_mutex_lock(&_pf.lock);
+	_pf.ncur = i;
+	pthread_cond_broadcast(&_pf.cond);
+	while (_pf.nready <= i)
+		pthread_cond_wait(&_pf.cond, &_pf.lock);
+	pthread_mutex_unlock(&_pf.lock);
+	return &_pf.ops[i];
+}
 
 int main(int argc, char *argv[])
 {
-	int fd, retv = 0;
-	char buf[BUFSIZ], *fn = "-";
-
-	if (argc == 1)
-		goto no_args;
-	while (--argc > 0) {
-		fn = *++argv;
-no_args:
-		fd = strcmp(fn, "-") ? open(fn, O_RDONLY) : STDIN_FILENO;
-		if (fd == -1) {
-			fprintf(stderr, "%s: open '%s' failed: %s\n", argv[0], fn, strerror(errno));
+	int i, opt, retv = 0;
+	struct operand *op;
+	struct stat st;
+	pthread_t thread;
+	int threaded = 0, stop = 0;
+	void *buf;
+
+	memset(&_g, 0, sizeof(_g));
+	memset(&_pf, 0, sizeof(_pf));
+	_g.exename = argv[0];
+	_g.usage_str = "[-bnsv] [-|FILE...]";
+	while ((opt = getopt(argc, argv, "bnsv")) != -1) {
+		switch (opt) {
+		case 'b': _g.opt_b = _g.opt_n = 1; break;
+		case 'n': _g.opt_n = 1; break;
+		case 's': _g.opt_s = 1; break;
+		case 'v': _g.opt_v = 1; break;
+		default:
+			return usage(NULL);
+		}
+	}
+	argc -= optind-1;
+	argv += optind-1;
+
+	if (_g.opt_n || _g.opt_s || _g.opt_v)
+		assert(_g.obuf = malloc(OUT_BUFSIZ));
+	if (fstat(STDOUT_FILENO, &st) == 0) {
+		_g.out_pipe = S_ISFIFO(st.st_mode);
+		_g.out_reg = S_ISREG(st.st_mode);
+	}
+	assert(posix_memalign(&buf, sysconf(_SC_PAGESIZE), CAT_BUFSIZ) == 0);
+	_g.buf = buf;
+
+	_pf.nops = argc > 1 ? argc-1 : 1;
+	assert(_pf.ops = calloc(_pf.nops, sizeof(*_pf.ops)));
+	for (i = 0; i < _pf.nops; i++)
+		_pf.ops[i].name = argc > 1 ? argv[i+1] : "-";
+	if (_pf.nops > 1) {
+		pthread_mutex_init(&_pf.lock, NULL);
+		pthread_cond_init(&_pf.cond, NULL);
+		threaded = pthread_create(&thread, NULL, prefetch, NULL) == 0;
+	}
+
+	for (i = 0; i < _pf.nops && !stop; i++) {
+		if (threaded)
+			op = next_operand(i);
+		else
+			open_operand(op = &_pf.ops[i]);
+		if (op->fd == -1) {
+			fprintf(stderr, "%s: open '%s' failed: %s\n", _g.exename, op->name, strerror(op->err));
 			retv |= EXIT_FAILURE;
-		} else {
-			ssize_t nread;
-			while ((nread = read(fd, buf, sizeof(buf))) > 0)
-				write(STDOUT_FILENO, buf, nread);
-			if (nread == -1) {
-				fprintf(stderr, "%s: read from '%s' failed: %s\n", argv[0], fn, strerror(errno));
-				retv |= EXIT_FAILURE;
-			}
-			if (fd != STDIN_FILENO)
-				close(fd);
+			continue;
 		}
+		switch (cat_fd(op->fd)) {
+		case COPY_RERR:
+			fprintf(stderr, "%s: read from '%s' failed: %s\n", _g.exename, op->name, strerror(errno));
+			retv |= EXIT_FAILURE;
+			break;
+		case COPY_WERR:
+			fprintf(stderr, "%s: write to stdout failed: %s\n", _g.exename, strerror(errno));
+			retv = EXIT_FAILURE;
+			stop = 1;
+		}
+		if (op->fd != STDIN_FILENO)
+			close(op->fd);
+	}
+	if (threaded) {
+		/* after a write error, let the prefetch thread run out */
+		pthread_mutex_lock(&_pf.lock);
+		_pf.ncur = _pf.nops;
+		pthread_cond_broadcast(&_pf.cond);
+		pthread_mutex_unlock(&_pf.lock);
+		pthread_join(thread, NULL);
+		for (; i < _pf.nops; i++)
+			if (_pf.ops[i].fd > STDIN_FILENO)
+				close(_pf.ops[i].fd);
+		pthread_mutex_destroy(&_pf.lock);
+		pthread_cond_destroy(&_pf.cond);
 	}
+	if (_g.obuf != NULL && !stop) {
+		out_flush();
+		if (_g.out_err) {
+			fprintf(stderr, "%s: write to stdout failed: %s\n", _g.exename, strerror(_g.out_err));
+			retv = EXIT_FAILURE;
+		}
+	}
+	free(_g.obuf);
+	free(_g.buf);
+	free(_pf.ops);
 
 	return retv;
 }
-
@@ -1,4 +1,3 @@
-
 #define	_POSIX_SOURCE
 
 #include <assert.h>
@@ -8,14 +7,20 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <dirent.h>
 #include <fcntl.h>
-#include <ftw.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#if defined __linux__
+#include <sys/sendfile.h>
+#endif
+
 
+/* --update comparison modes */
+enum { UPDATE_NONE = 0, UPDATE_MTIME, UPDATE_SIZE, UPDATE_CHECKSUM };
 
 static struct {
 	char *exename,
@@ -24,10 +29,14 @@ static struct {
 	    opt_p,	/* -p: duplicate file metadata */
 	    opt_R,	/* -R: recursive */
 	    opt_L,	/* -L: follow symlink */
-	    opt_v;
+	    opt_v,
+	    opt_update;	/* --update: skip files already up to date in TARGET */
 	char *target;
 } _g;
 
+/* chunk size of data copies and of --update=checksum comparisons */
+#define	COPY_BUFSIZ	(128*1024)
+
 /**
  *  formats error message and append strerror(errno) */
 static int ERR(const char *fmt, ...)
@@ -58,7 +67,16 @@ static void usage(char *msg, ...)
 static int path_isdir(const char *pathname)
 {
 	struct stat sbuf;
-	return (_g.opt_L ? stat(pathname, &sbuf) : lstat(pathname, &sbuf)) != 0 && S_ISDIR(sbuf.st_mode) ? 1 : 0;
+	return stat(pathname, &sbuf) == 0 && S_ISDIR(sbuf.st_mode) ? 1 : 0;
+}
+
+/* malloc'd "DIR/NAME", used for diagnostics of dirfd-relative operations */
+static char *path_join(const char *dir, const char *name)
+{
+	char *p;
+	assert(p = malloc(strlen(dir) + strlen(name) + 2));
+	sprintf(p, "%s/%s", dir, name);
+	return p;
 }
 
 static int confirm_overwrite(const char *pathname)
@@ -82,107 +100,300 @@ static int confirm_overwrite(const char *pathname)
 	} while(1);
 }
 
-static int do_single_cp(const char *dest_path, char *src_path)
+/* read(2) until LEN bytes, EOF or error */
+static ssize_t read_full(int fd, char *buf, size_t len)
 {
-	struct stat sbuf, lsbuf;
-	int dest_fd, src_fd;
-	ssize_t nread, nwritten;
-	char buf[PATH_MAX];
+	size_t n = 0;
+	ssize_t retv;
+	while (n < len) {
+		if ((retv = read(fd, buf+n, len-n)) == 0)
+			break;
+		else if (retv == -1 && errno == EINTR)
+			continue;
+		else if (retv == -1)
+			return -1;
+		n += retv;
+	}
+	return n;
+}
 
-	assert(dest_path && src_path);
+/**
+ *  Byte-wise comparison of two (equally sized) regular files,
+ *  bailing out on the first differing chunk */
+static int same_content(int sdirfd, const char *sname, int ddirfd, const char *dname)
+{
+	static char *sbuf, *dbuf;
+	int sfd, dfd, same = 0;
+	ssize_t snread, dnread;
+
+	if (sbuf == NULL) {
+		assert(sbuf = malloc(COPY_BUFSIZ));
+		assert(dbuf = malloc(COPY_BUFSIZ));
+	}
+	if ((sfd = openat(sdirfd, sname, O_RDONLY)) == -1)
+		return 0;
+	if ((dfd = openat(ddirfd, dname, O_RDONLY)) == -1) {
+		close(sfd);
+		return 0;
+	}
+	do {
+		snread = read_full(sfd, sbuf, COPY_BUFSIZ);
+		dnread = read_full(dfd, dbuf, COPY_BUFSIZ);
+		if (snread == -1 || snread != dnread)
+			break;
+		if (snread == 0)
+			same = 1;
+	} while (!same && memcmp(sbuf, dbuf, snread) == 0);
+	close(dfd);
+	close(sfd);
+	return same;
+}
+
+/**
+ *  --update: nonzero when DNAME (relative to the already opened target
+ *  directory DDIRFD), described by DSB or NULL if missing, matches the
+ *  source described by SSB, meaning the copy can be skipped.  Only the
+ *  size and type are compared for --update=size, --update=mtime
+ *  additionally requires the target to be no older than the source and
+ *  --update=checksum compares the file contents */
+static int dest_unchanged(const struct stat *ssb, int sdirfd, const char *sname,
+		const struct stat *dsb, int ddirfd, const char *dname)
+{
+	if (dsb == NULL)
+		return 0;
+	if ((ssb->st_mode & S_IFMT) != (dsb->st_mode & S_IFMT) || ssb->st_size != dsb->st_size)
+		return 0;
+
+	switch (_g.opt_update) {
+	case UPDATE_MTIME:
+		return dsb->st_mtim.tv_sec > ssb->st_mtim.tv_sec
+			|| dsb->st_mtim.tv_sec == ssb->st_mtim.tv_sec
+			&& dsb->st_mtim.tv_nsec >= ssb->st_mtim.tv_nsec;
+	case UPDATE_SIZE:
+		return 1;
+	case UPDATE_CHECKSUM:
+		return S_ISREG(ssb->st_mode) ? same_content(sdirfd, sname, ddirfd, dname) : 1;
+	default:
+		return 0;
+	}
+}
+
+static int copy_data(int src_fd, int dest_fd, const char *src_path, const char *dest_path)
+{
+#if defined __linux__ /* >= 2.6.33 */
+	ssize_t nwritten;
+	while ((nwritten = sendfile(dest_fd, src_fd, NULL, COPY_BUFSIZ)) > 0) ;
+	if (nwritten == -1)
+		return ERR("sendfile '%s' -> '%s'", src_path, dest_path);
+#else
+	static char *buf;
+	ssize_t nread, nwritten, retv;
+
+	if (buf == NULL)
+		assert(buf = malloc(COPY_BUFSIZ));
+	for (nwritten = 0; (nread = read(src_fd, buf, COPY_BUFSIZ)) > 0; nwritten=0 ) {
+eagain:
+		while ((retv = write(dest_fd, buf+nwritten, nread-nwritten)) > 0)
+			nwritten += retv;
+		if (retv == -1 && (errno == EAGAIN || errno == EINTR))
+			goto eagain;
+		else if (retv == -1)
+			return ERR("write '%s'", dest_path);
+	}
+	if (nread == -1)
+		return ERR("read '%s'", src_path);
+#endif
+	return EXIT_SUCCESS;
+}
+
+/* -p: carry ownership, permissions and timestamps over to DNAME */
+static void copy_metadata(const struct stat *ssb, int ddirfd, const char *dname)
+{
+	struct timespec times[2];
+	int flags = S_ISLNK(ssb->st_mode) ? AT_SYMLINK_NOFOLLOW : 0;
+
+	times[0] = ssb->st_atim;
+	times[1] = ssb->st_mtim;
+	/* chown failure (EPERM as non-root) is not fatal */
+	fchownat(ddirfd, dname, ssb->st_uid, ssb->st_gid, flags);
+	if (!S_ISLNK(ssb->st_mode))
+		fchmodat(ddirfd, dname, ssb->st_mode & 07777, 0);
+	utimensat(ddirfd, dname, times, flags);
+}
+
+static int copy_entry(int sdirfd, const char *sname, const char *src_path,
+		int ddirfd, const char *dname, const char *dest_path);
+
+/**
+ *  Recursively copy the (opened) directory SFD into DNAME.  Every entry
+ *  is stat'ed and created relative to the directory descriptors, so each
+ *  source and target directory is resolved once per traversal */
+static int copy_dir(int sfd, const struct stat *ssb, const char *src_path,
+		int ddirfd, const char *dname, const char *dest_path)
+{
+	struct dirent *dent;
+	DIR *dir;
+	int dfd, retv = EXIT_SUCCESS;
+
+	if (mkdirat(ddirfd, dname, ssb->st_mode & 07777 | S_IRWXU) == -1 && errno != EEXIST) {
+		close(sfd);
+		return ERR("mkdir '%s'", dest_path);
+	}
+	if ((dfd = openat(ddirfd, dname, O_RDONLY | O_DIRECTORY)) == -1) {
+		close(sfd);
+		return ERR("open '%s'", dest_path);
+	}
+	if ((dir = fdopendir(sfd)) == NULL) {
+		close(sfd);
+		close(dfd);
+		return ERR("opendir '%s'", src_path);
+	}
+
+	while (errno = 0, (dent = readdir(dir)) != NULL) {
+		char *sp, *dp;
+		if (dent->d_name[0] == '.' && (dent->d_name[1] == '\0'
+			|| dent->d_name[1] == '.' && dent->d_name[2] == '\0'))
+			continue;
+		sp = path_join(src_path, dent->d_name);
+		dp = path_join(dest_path, dent->d_name);
+		retv |= copy_entry(sfd, dent->d_name, sp, dfd, dent->d_name, dp);
+		free(sp);
+		free(dp);
+	}
+	if (errno != 0)
+		retv |= ERR("readdir '%s'", src_path);
+	closedir(dir);
+
+	if (_g.opt_p)
+		copy_metadata(ssb, dfd, ".");
+	else if ((ssb->st_mode & S_IRWXU) != S_IRWXU)
+		fchmod(dfd, ssb->st_mode & 07777);
+	close(dfd);
+	return retv;
+}
+
+/**
+ *  Copy SNAME (relative to SDIRFD) to DNAME (relative to DDIRFD), SRC_PATH
+ *  and DEST_PATH are the corresponding pathnames for diagnostics */
+static int copy_entry(int sdirfd, const char *sname, const char *src_path,
+		int ddirfd, const char *dname, const char *dest_path)
+{
+	struct stat ssb, dsb;
+	int src_fd, dest_fd, retv, dexists;
+	ssize_t nread;
+	char buf[PATH_MAX], dbuf[PATH_MAX];
+
+	if (fstatat(sdirfd, sname, &ssb, _g.opt_L ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+		return ERR("stat '%s'", src_path);
+
+	if (S_ISDIR(ssb.st_mode)) {
+		if (!_g.opt_R) {
+			fprintf(stderr, "%s: omitting directory '%s'\n", _g.exename, src_path);
+			return EXIT_FAILURE;
+		}
+		if (_g.opt_v)
+			fprintf(stdout, "%s: %s -> %s\n", _g.exename, src_path, dest_path);
+		if ((src_fd = openat(sdirfd, sname, O_RDONLY | O_DIRECTORY)) == -1)
+			return ERR("open '%s'", src_path);
+		return copy_dir(src_fd, &ssb, src_path, ddirfd, dname, dest_path);
+	}
+
+	/* the only stat of the destination */
+	dexists = fstatat(ddirfd, dname, &dsb, AT_SYMLINK_NOFOLLOW) != -1;
+
+	if (S_ISLNK(ssb.st_mode)) {
+		if ((nread = readlinkat(sdirfd, sname, buf, sizeof(buf)-1)) == -1)
+			return ERR("readlink '%s'", src_path);
+		buf[nread] = '\0';
+		if (_g.opt_update && dexists && S_ISLNK(dsb.st_mode)) {
+			ssize_t dnread = readlinkat(ddirfd, dname, dbuf, sizeof(dbuf)-1);
+			if (dnread == nread && memcmp(buf, dbuf, nread) == 0)
+				return EXIT_SUCCESS;
+		}
+	} else if (_g.opt_update && dest_unchanged(&ssb, sdirfd, sname, dexists ? &dsb : NULL, ddirfd, dname))
+		return EXIT_SUCCESS;
 
 	if (_g.opt_v)
 		fprintf(stdout, "%s: %s -> %s\n", _g.exename, src_path, dest_path);
 
-	if (path_isdir(dest_path) || path_isdir(src_path))
-		usage("unexpected directory-type argument\n");
-	if (stat(dest_path, &sbuf) != -1)
+	if (dexists) {
+		if (S_ISDIR(dsb.st_mode)) {
+			errno = EISDIR;
+			return ERR("cannot overwrite '%s'", dest_path);
+		}
 		if (_g.opt_prompt == 0 || confirm_overwrite(dest_path)) {
-			if (unlink(dest_path) == -1)
+			if (unlinkat(ddirfd, dname, 0) == -1)
 				return ERR("unlink '%s'", dest_path);
 		} else
 			return EXIT_SUCCESS;
+	}
 
-	if (lstat(src_path, &lsbuf) != -1) {
-		if (S_ISLNK(lsbuf.st_mode)) {
-			nread = readlink(src_path, buf, PATH_MAX);
-			if (nread != -1) {
-				buf[nread] = '\0';
-				if (symlink(buf, dest_path) == -1)
-					return ERR("symlink '%s'", dest_path);
-				return EXIT_SUCCESS;
-			} else
-				return ERR("readlink '%s'", src_path);
-		}
-	} else
-		return ERR("stat '%s'", src_path);
+	if (S_ISLNK(ssb.st_mode)) {
+		if (symlinkat(buf, ddirfd, dname) == -1)
+			return ERR("symlink '%s'", dest_path);
+		if (_g.opt_p)
+			copy_metadata(&ssb, ddirfd, dname);
+		return EXIT_SUCCESS;
+	}
 
-	if ((src_fd = open(src_path, O_RDONLY)) < 0)
-		return ERR("open '%s'", dest_path);
-	if ((dest_fd = creat(dest_path, lsbuf.st_mode)) < 0)
-		return ERR("creat '%s'", src_path);
-#if defined __linux__ /* >= 2.6.33 */
-	while ((nwritten = sendfile(dest_fd, src_fd, NULL, BUFSIZ)) > 0) ;
-	if (nwritten == -1)
-		ERR("sendfile '%s' -> '%s'", src_path, dest_path);
-#else
-	{
-		ssize_t retv;
-		for (nwritten = 0; (nread = read(src_fd, buf, BUFSIZ)) > 0; nwritten=0 ) {
-eagain:
-			while ((retv = write(dest_fd, buf+nwritten, nread-nwritten)) > 0)
-				nwritten += retv;
-			if (retv == -1 && errno == EAGAIN)
-				goto eagain;
-			else if (retv == -1) {
-				ERR("write '%s'", dest_path);
-				break;
-			}
-		}
+	if ((src_fd = openat(sdirfd, sname, O_RDONLY)) < 0)
+		return ERR("open '%s'", src_path);
+	if ((dest_fd = openat(ddirfd, dname, O_WRONLY | O_CREAT | O_TRUNC, ssb.st_mode & 07777)) < 0) {
+		close(src_fd);
+		return ERR("creat '%s'", dest_path);
 	}
-#endif
+	retv = copy_data(src_fd, dest_fd, src_path, dest_path);
 	close(dest_fd);
 	close(src_fd);
-	return EXIT_SUCCESS;
+	if (_g.opt_p)
+		copy_metadata(&ssb, ddirfd, dname);
+	return retv;
 }
 
-static int do_ftw_cp(const char *name, const struct stat *ptr, int flag, struct FTW *ftwbuf)
+static int do_single_cp(const char *dest_path, char *src_path)
 {
-	return 0;
+	assert(dest_path && src_path);
+	return copy_entry(AT_FDCWD, src_path, src_path, AT_FDCWD, dest_path, dest_path);
 }
 
 static int do_cp(const char *dest_path, char* const* pathnamev, size_t nargs)
 {
-	struct stat sbuf, lsbuf;
-	char buf[PATH_MAX];
+	int dest_fd, retv = EXIT_SUCCESS;
 	size_t i;
 
 	assert(dest_path && pathnamev && nargs > 0);
-	if (path_isdir(dest_path))
+	if (!path_isdir(dest_path))
 		usage("invokation requires a directory target.\n");
 
+	/* the target directory is only looked up once for all operands */
+	if ((dest_fd = open(dest_path, O_RDONLY | O_DIRECTORY)) == -1)
+		return ERR("open '%s'", dest_path);
+
 	for (i=0; i<nargs; i++) {
-		if (stat(pathnamev[i], &sbuf) == -1)
-			return ERR("stat '%s'", pathnamev[i]);
-		if (lstat(pathnamev[i], &lsbuf) == -1)
-			return ERR("lstat '%s'", pathnamev[i]);
-		if (!(S_ISDIR(lsbuf.st_mode) || S_ISLNK(lsbuf.st_mode) && S_ISDIR(sbuf.st_mode) && _g.opt_L)) {
-			snprintf(buf, sizeof buf, "%s/%s", dest_path, basename(pathnamev[i]));
-			do_single_cp(buf, pathnamev[i]);
-		} else if (nftw(pathnamev[i], do_ftw_cp, 16, (_g.opt_L ? 0 : FTW_PHYS) | 0) == -1)
-			return ERR("ftw '%s'", pathnamev[i]);
+		char *src = strdup(pathnamev[i]), *name, *dp;
+		assert(src != NULL);
+		name = basename(src);
+		dp = path_join(dest_path, name);
+		retv |= copy_entry(AT_FDCWD, pathnamev[i], pathnamev[i], dest_fd, name, dp);
+		free(dp);
+		free(src);
 	}
 
-	return 0;
+	close(dest_fd);
+	return retv;
 }
 
 int main(int argc, char *argv[])
 {
+	static struct option longopts[] = {
+		{ "update", optional_argument, NULL, 'u' },
+		{ NULL, 0, NULL, 0 }
+	};
 	int opt, retv=EXIT_SUCCESS;
-	
+
 	_g.exename = argv[0];
-	_g.usage_str = "[-ifpRLv] SRC... TARGET";
-	while ((opt = getopt(argc, argv, "ifpRLv")) != -1)
+	_g.usage_str = "[-ifpRLv] [--update[=mtime|size|checksum]] SRC... TARGET";
+	while ((opt = getopt_long(argc, argv, "ifpRLv", longopts, NULL)) != -1)
 		switch (opt) {
 		case 'i': _g.opt_prompt = 1; break;
 		case 'f': _g.opt_prompt = 0; break;
@@ -190,6 +401,16 @@ int main(int argc, char *argv[])
 		case 'R': _g.opt_R = 1; break;
 		case 'L': _g.opt_L = 1; break;
 		case 'v': _g.opt_v = 1; break;
+		case 'u':
+			if (optarg == NULL || !strcmp(optarg, "mtime"))
+				_g.opt_update = UPDATE_MTIME;
+			else if (!strcmp(optarg, "size"))
+				_g.opt_update = UPDATE_SIZE;
+			else if (!strcmp(optarg, "checksum"))
+				_g.opt_update = UPDATE_CHECKSUM;
+			else
+				usage("invalid --update mode '%s'\n", optarg);
+			break;
 		default:
 			usage(NULL);
 		}
@@ -200,10 +421,9 @@ int main(int argc, char *argv[])
 	/* is last arg a directory */
 	_g.target = argv[argc-1];
 
-	if (argc-optind == 2 && !(path_isdir(argv[optind])||path_isdir(argv[optind+1])))
+	if (argc-optind == 2 && !path_isdir(argv[optind+1]))
 		retv = do_single_cp(argv[optind+1], argv[optind]);
 	else
 		retv = do_cp(argv[argc-1], &argv[optind], argc-optind-1);
 	return retv;
 }
-
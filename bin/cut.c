@@ -1,12 +1,16 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -15,21 +19,74 @@ struct integer_range {
 	     hi_bound;
 };
 
+/* output buffer, flushed to stdout when full unless it grows instead */
+struct outbuf {
+	char *buf;
+	size_t len, cap;
+	int grow;
+};
+
+#define	LOW_MAP_BITS	1024
+
 static struct {
 	char *exename,
 	     *usage_str;
 
 	char *opt_delim;
+	int opt_mode;		/* 'f'ields, 'b'ytes or 'c'haracters */
+
+	char *opt_list;
+	struct integer_range *ranges;	/* sorted and merged by compile_list() */
+	size_t num_ranges;
+	long max_pos;			/* highest selected field or position */
+	unsigned char low_map[LOW_MAP_BITS/CHAR_BIT];	/* positions 1..LOW_MAP_BITS */
+
+	unsigned char is_delim[UCHAR_MAX+1];
+
+	int opt_j;		/* -j: # of threads for regular files */
 
-	char *opt_fields;
-	struct integer_range *fields;
-	size_t num_fields;
+	char *ibuf;		/* input buffer */
+	size_t ibufsz;
+	struct outbuf out;
+	int out_err;		/* errno of a failed write */
 } _g;
 
+/* input is read in chunks of at least READ_BUFSIZ, a longer line grows the buffer */
+#define	READ_BUFSIZ	(1024*1024)
+#define	OUT_BUFSIZ	(256*1024)
+
+/*
+ *  -j: a regular file larger than a chunk is mapped and cut by a pool of
+ *  threads, each taking the next CHUNK_SIZE bytes (up to the following
+ *  newline) and cutting them to the output buffer of its slot.  The main
+ *  thread writes out the slots in chunk order, a slot is reused for the
+ *  chunk NSLOTS later once written.
+ */
+#define	CHUNK_SIZE	(4*1024*1024)
+#define	MAX_THREADS	64
+
+enum { SLOT_FREE, SLOT_BUSY, SLOT_DONE };
+
+struct chunk_slot {
+	struct outbuf out;
+	unsigned long chunk;	/* # of the chunk held */
+	int state;
+};
+
+static struct {
+	const char *next, *end;		/* the mapped file, yet to be handed out */
+	unsigned long nchunks;		/* # of chunks handed out */
+	struct chunk_slot *slots;
+	size_t nslots;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* any slot changed state */
+} _par;
+
 
 static void str_to_ranged_list(char *str, struct integer_range **, size_t *);
 static int do_cut(char *filename);
-static void do_fields(char *line);
+static void do_fields(struct outbuf *o, const char *line, size_t len);
+static void do_bytes(struct outbuf *o, const char *line, size_t len);
 static void usage(char *msg, ...);
 
 
@@ -45,46 +102,293 @@ void usage(char *msg, ...)
 	fprintf(stderr, "Usage: %s %s\n", _g.exename, _g.usage_str);
 }
 
-int do_cut(char *filename)
+/* write all of P to stdout, the first error sticks in _g.out_err */
+static void write_out(const char *p, size_t len)
 {
-	FILE *fp = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
-	char *line = NULL;
-	size_t n = 0;
+	ssize_t n;
+	while (len > 0 && !_g.out_err) {
+		if ((n = write(STDOUT_FILENO, p, len)) == -1) {
+			if (errno != EINTR && errno != EAGAIN)
+				_g.out_err = errno;
+			continue;
+		}
+		p += n;
+		len -= n;
+	}
+}
 
+static void out_flush(struct outbuf *o)
+{
+	write_out(o->buf, o->len);
+	o->len = 0;
+}
 
-	if (fp == NULL) {
-		fprintf(stderr, "%s: opening '%s' failed: %s\n", _g.exename, filename, strerror(errno));
-		return EXIT_FAILURE;
-	} else while (getline(&line, &n, fp) != -1) {
-		if (line[strlen(line)-1] == '\n')
-			line[strlen(line)-1] = '\0';
-		if (_g.opt_fields)
-			do_fields(line);
+static void out_write(struct outbuf *o, const char *p, size_t len)
+{
+	if (o->len + len > o->cap) {
+		if (o->grow) {
+			while (o->len + len > o->cap)
+				o->cap *= 2;
+			assert(o->buf = realloc(o->buf, o->cap));
+		} else {
+			out_flush(o);
+			if (len >= o->cap) {
+				write_out(p, len);
+				return;
+			}
+		}
 	}
+	memcpy(o->buf+o->len, p, len);
+	o->len += len;
+}
 
-	if (ferror(fp))
-		fprintf(stderr, "%s: error reading '%s': %s\n", _g.exename, filename, strerror(errno));
+static int range_cmp(const void *p1, const void *p2)
+{
+	const struct integer_range *r1 = p1, *r2 = p2;
+	return r1->lo_bound < r2->lo_bound ? -1 : r1->lo_bound > r2->lo_bound;
+}
 
-	if (line) free(line);
-	if (fp != stdin)
-		fclose(fp);
-	return EXIT_SUCCESS;
+/**
+ *  Sorts and merges the overlapping or adjacent ranges of the list, and
+ *  maps the selected positions up to LOW_MAP_BITS */
+static void compile_list(void)
+{
+	struct integer_range *r = _g.ranges;
+	size_t i, n = 0;
+	long pos;
+
+	qsort(r, _g.num_ranges, sizeof(*r), range_cmp);
+	for (i = 0; i < _g.num_ranges; i++)
+		if (n > 0 && (r[n-1].hi_bound == LONG_MAX || r[i].lo_bound <= r[n-1].hi_bound+1)) {
+			if (r[i].hi_bound > r[n-1].hi_bound)
+				r[n-1].hi_bound = r[i].hi_bound;
+		} else
+			r[n++] = r[i];
+	_g.num_ranges = n;
+	_g.max_pos = n > 0 ? r[n-1].hi_bound : 0;
+	for (i = 0; i < n; i++)
+		for (pos = r[i].lo_bound; pos <= r[i].hi_bound && pos <= LOW_MAP_BITS; pos++)
+			_g.low_map[(pos-1)/CHAR_BIT] |= 1 << (pos-1)%CHAR_BIT;
 }
 
-void do_fields(char *line)
+/* field # N is in the list */
+static int in_list(long n)
 {
+	size_t lo = 0, hi = _g.num_ranges, mid;
+	if (n <= LOW_MAP_BITS)
+		return _g.low_map[(n-1)/CHAR_BIT] >> (n-1)%CHAR_BIT & 1;
+	while (lo < hi) {
+		mid = lo + (hi-lo)/2;
+		if (n < _g.ranges[mid].lo_bound)
+			hi = mid;
+		else if (n > _g.ranges[mid].hi_bound)
+			lo = mid+1;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+/* first delimiter in [P, END), END if none */
+static const char *next_delim(const char *p, const char *end)
+{
+	if (_g.opt_delim[1] == '\0') {
+		const char *q = memchr(p, _g.opt_delim[0], end - p);
+		return q ? q : end;
+	}
+	while (p < end && !_g.is_delim[(unsigned char)*p])
+		p++;
+	return p;
+}
+
+/**
+ *  Splits [LINE, LINE+LEN) at every delimiter, so that adjacent delimiters
+ *  delimit empty fields, and outputs the selected ones separated by DELIM[0].
+ *  Scanning stops past the highest selected field.  A line without
+ *  delimiters is output as is */
+void do_fields(struct outbuf *o, const char *line, size_t len)
+{
+	const char *p = line, *end = line + len, *q = next_delim(p, end);
 	long fnr = 0;
-	char *p;
-	for (p = strtok(line, _g.opt_delim); p; p = strtok(NULL, _g.opt_delim)) {
-		size_t i;
-		fnr++;
-		for (i = 0; i < _g.num_fields; i++)
-			if (fnr >= _g.fields[i].lo_bound && fnr <= _g.fields[i].hi_bound) {
-				if (i > 0) printf("%c", _g.opt_delim[0]);
-				printf("%s", p);
-			}
+	int first = 1;
+
+	if (q == end) {
+		out_write(o, line, len);
+		out_write(o, "\n", 1);
+		return;
 	}
-	putchar('\n');
+	for (;;) {
+		if (in_list(++fnr)) {
+			if (!first)
+				out_write(o, _g.opt_delim, 1);
+			out_write(o, p, q - p);
+			first = 0;
+		}
+		if (q == end || fnr == _g.max_pos)
+			break;
+		p = q + 1;
+		q = next_delim(p, end);
+	}
+	out_write(o, "\n", 1);
+}
+
+/* -b and -c: each range is output as one run */
+void do_bytes(struct outbuf *o, const char *line, size_t len)
+{
+	size_t i;
+	for (i = 0; i < _g.num_ranges && (size_t)_g.ranges[i].lo_bound <= len; i++) {
+		size_t lo = _g.ranges[i].lo_bound - 1, hi = _g.ranges[i].hi_bound;
+		out_write(o, line+lo, (hi < len ? hi : len) - lo);
+	}
+	out_write(o, "\n", 1);
+}
+
+/* cut the complete lines of [P, END), returns the start of the partial last line */
+static const char *cut_lines(struct outbuf *o, const char *p, const char *end)
+{
+	const char *nl;
+	for (; (nl = memchr(p, '\n', end - p)) != NULL; p = nl+1)
+		(_g.opt_mode == 'f' ? do_fields : do_bytes)(o, p, nl - p);
+	return p;
+}
+
+static void *cut_worker(void *arg)
+{
+	struct chunk_slot *slot;
+	const char *start, *stop;
+
+	(void)arg;
+	pthread_mutex_lock(&_par.lock);
+	while (_par.next < _par.end) {
+		slot = &_par.slots[_par.nchunks % _par.nslots];
+		if (slot->state != SLOT_FREE) {
+			pthread_cond_wait(&_par.cond, &_par.lock);
+			continue;
+		}
+		start = _par.next;
+		if ((size_t)(_par.end - start) <= CHUNK_SIZE
+				|| (stop = memchr(start + CHUNK_SIZE, '\n', _par.end - start - CHUNK_SIZE)) == NULL)
+			stop = _par.end;
+		else
+			stop++;
+		_par.next = stop;
+		slot->chunk = _par.nchunks++;
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&_par.lock);
+
+		slot->out.len = 0;
+		if ((start = cut_lines(&slot->out, start, stop)) < stop)
+			(_g.opt_mode == 'f' ? do_fields : do_bytes)(&slot->out, start, stop - start);
+
+		pthread_mutex_lock(&_par.lock);
+		slot->state = SLOT_DONE;
+		pthread_cond_broadcast(&_par.cond);
+	}
+	pthread_mutex_unlock(&_par.lock);
+	return NULL;
+}
+
+/**
+ *  -j: cut the SIZE bytes regular file FD in parallel
+ *  @return {int} - -1 if the file can't be mapped, to be read instead */
+static int cut_parallel(int fd, size_t size)
+{
+	pthread_t threads[MAX_THREADS];
+	struct chunk_slot *slot;
+	unsigned long k;
+	char *map;
+	int i, nthreads = 0, done;
+
+	if ((map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		return -1;
+	posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+	out_flush(&_g.out);
+
+	_par.next = map;
+	_par.end = map + size;
+	_par.nchunks = 0;
+	if (_par.slots == NULL) {
+		_par.nslots = 2*_g.opt_j;
+		assert(_par.slots = calloc(_par.nslots, sizeof(*_par.slots)));
+		for (i = 0; i < (int)_par.nslots; i++) {
+			_par.slots[i].out.cap = OUT_BUFSIZ;
+			_par.slots[i].out.grow = 1;
+			assert(_par.slots[i].out.buf = malloc(OUT_BUFSIZ));
+		}
+		pthread_mutex_init(&_par.lock, NULL);
+		pthread_cond_init(&_par.cond, NULL);
+	}
+	for (i = 0; i < _g.opt_j; i++)
+		if (pthread_create(&threads[nthreads], NULL, cut_worker, NULL) == 0)
+			nthreads++;
+	if (nthreads == 0) {
+		munmap(map, size);
+		return -1;
+	}
+
+	for (k = 0; ; k++) {
+		slot = &_par.slots[k % _par.nslots];
+		pthread_mutex_lock(&_par.lock);
+		while (!(slot->state == SLOT_DONE && slot->chunk == k)
+				&& !(_par.next == _par.end && k == _par.nchunks))
+			pthread_cond_wait(&_par.cond, &_par.lock);
+		done = k == _par.nchunks;
+		pthread_mutex_unlock(&_par.lock);
+		if (done)
+			break;
+		write_out(slot->out.buf, slot->out.len);
+		pthread_mutex_lock(&_par.lock);
+		slot->state = SLOT_FREE;
+		pthread_cond_broadcast(&_par.cond);
+		pthread_mutex_unlock(&_par.lock);
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	munmap(map, size);
+	return 0;
+}
+
+int do_cut(char *filename)
+{
+	int fd = strcmp(filename, "-") ? open(filename, O_RDONLY) : STDIN_FILENO;
+	size_t len = 0;
+	ssize_t n;
+	const char *p;
+	char *end;
+	struct stat st;
+
+	if (fd == -1) {
+		fprintf(stderr, "%s: opening '%s' failed: %s\n", _g.exename, filename, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (_g.opt_j > 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > CHUNK_SIZE
+			&& (size_t)st.st_size == st.st_size && cut_parallel(fd, st.st_size) == 0) {
+		if (fd != STDIN_FILENO)
+			close(fd);
+		return EXIT_SUCCESS;
+	}
+	/* LEN bytes of a partial line are left over at the start of the buffer */
+	while ((n = read(fd, _g.ibuf+len, _g.ibufsz-len)) != 0) {
+		if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			break;
+		}
+		end = _g.ibuf + len + n;
+		p = cut_lines(&_g.out, _g.ibuf, end);
+		if ((len = end - p) > 0)
+			memmove(_g.ibuf, p, len);
+		if (len == _g.ibufsz)
+			assert(_g.ibuf = realloc(_g.ibuf, _g.ibufsz *= 2));
+	}
+	if (n == -1)
+		fprintf(stderr, "%s: error reading '%s': %s\n", _g.exename, filename, strerror(errno));
+	else if (len > 0)
+		(_g.opt_mode == 'f' ? do_fields : do_bytes)(&_g.out, _g.ibuf, len);
+
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return n == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 void str_to_ranged_list(char *str, struct integer_range **ranges, size_t *num_ranges)
@@ -96,17 +400,21 @@ void str_to_ranged_list(char *str, struct integer_range **ranges, size_t *num_ra
 		struct integer_range range;
 
 		errno = 0;
-		if ( (range.lo_bound = strtol(p, &endptr, 10)) == 0 && (errno || endptr == p) )
+		if (*p == '-')	/* -END */
+			range.lo_bound = 1, endptr = p;
+		else if ( (range.lo_bound = strtol(p, &endptr, 10)) == 0 && (errno || endptr == p) )
 			continue;
 		if (*endptr == '-') {
 			p = endptr+1;
 			errno = 0;
-			if ( (range.hi_bound = strtol(p, &endptr, 10)) == 0 && (errno || endptr == p) )
+			if (*p == '\0')	/* START- */
+				range.hi_bound = LONG_MAX;
+			else if ( (range.hi_bound = strtol(p, &endptr, 10)) == 0 && (errno || endptr == p) )
 				continue;
 		} else
 			range.hi_bound = range.lo_bound;
 
-		if (range.lo_bound < 0 || range.hi_bound < 0 || range.lo_bound > range.hi_bound)
+		if (range.lo_bound < 1 || range.lo_bound > range.hi_bound)
 			continue;
 		(*num_ranges)++;
 		assert(*ranges = realloc(*ranges, sizeof(**ranges)**num_ranges));
@@ -117,15 +425,29 @@ void str_to_ranged_list(char *str, struct integer_range **ranges, size_t *num_ra
 int main(int argc, char *argv[])
 {
 	int opt, retv=EXIT_SUCCESS;
-	
+	char *p;
+
 	_g.exename = argv[0];
-	_g.usage_str = "[-d DELIM] [-f FIELD...] [-|FILE...]"
-		       "\n\tFIELD := START[-END][,FIELD]"
-		       "\n\tDELIM is a char string, output separator is DELIM[0]";
-	while ((opt = getopt(argc, argv, "d:f:")) != -1) {
+	_g.usage_str = "[-j THREADS] -b FIELD... | -c FIELD... | [-d DELIM] -f FIELD... [-|FILE...]"
+		       "\n\tFIELD := [START]-[END][,FIELD] | START[,FIELD]"
+		       "\n\tDELIM is a char string, output separator is DELIM[0]"
+		       "\n\t-b and -c select bytes, characters are single bytes"
+		       "\n\t-j cuts regular files in parallel";
+	while ((opt = getopt(argc, argv, "b:c:d:f:j:")) != -1) {
 		switch (opt) {
 		case 'd': _g.opt_delim = optarg; break;
-		case 'f': _g.opt_fields = optarg; break;
+		case 'j':
+			if ((_g.opt_j = atoi(optarg)) < 1 || _g.opt_j > MAX_THREADS) {
+				usage("invalid number of threads '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+		case 'c':
+		case 'f':
+			_g.opt_mode = opt;
+			_g.opt_list = optarg;
+			break;
 		default:
 			usage(NULL);
 			exit(EXIT_FAILURE);
@@ -133,13 +455,26 @@ int main(int argc, char *argv[])
 	}
 
 	if (!_g.opt_delim) _g.opt_delim = " \t";
-	if (_g.opt_fields) str_to_ranged_list(_g.opt_fields, &_g.fields, &_g.num_fields);
+	if (!_g.opt_list || !*_g.opt_delim) {
+		usage(_g.opt_list ? "empty delimiter\n" : "one of -b, -c or -f is required\n");
+		exit(EXIT_FAILURE);
+	}
+	str_to_ranged_list(_g.opt_list, &_g.ranges, &_g.num_ranges);
+	compile_list();
+	for (p = _g.opt_delim; *p; p++)
+		_g.is_delim[(unsigned char)*p] = 1;
 
+	assert(_g.ibuf = malloc(_g.ibufsz = READ_BUFSIZ));
+	assert(_g.out.buf = malloc(_g.out.cap = OUT_BUFSIZ));
 	if (optind >= argc)
 		retv = do_cut("-");
 	else for ( ; optind < argc; optind++ )
 		retv |= do_cut(argv[optind]);
 
+	out_flush(&_g.out);
+	if (_g.out_err) {
+		fprintf(stderr, "%s: error writing output: %s\n", _g.exename, strerror(_g.out_err));
+		retv = EXIT_FAILURE;
+	}
 	return retv;
 }
-
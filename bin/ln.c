@@ -8,7 +8,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-struct {
+static struct {
 	int opt_s, opt_f;
 	int opt_v;
 	int dest_isdir;
@@ -16,7 +16,7 @@ struct {
 	char *dest;
 } _g;
 
-void usage(const char *msg)
+static void usage(const char *msg)
 {
 	if (msg)
 		fprintf(stderr, "%s: %s\n", _g.exename, msg);
@@ -30,6 +30,7 @@ int main(int argc, char *argv[])
 	int opt, retv;
 	struct stat sbuf;
 
+	memset(&_g, 0, sizeof(_g));
 	_g.exename = argv[0];
 	while ((opt = getopt(argc, argv, "fsv")) != -1)
 		switch (opt) {
@@ -79,6 +80,8 @@ int main(int argc, char *argv[])
 			if (unlink(linkpath) == -1) {
 				fprintf(stderr, "%s: unable to unlink '%s': %s\n",
 						_g.exename, linkpath, strerror(errno));
+				if (_g.dest_isdir)
+					free(linkpath);
 				return EXIT_FAILURE;
 			}
 			retv = _g.opt_s ? symlink(argv[optind], linkpath) :
@@ -87,6 +90,8 @@ int main(int argc, char *argv[])
 		if (retv == -1 && !_g.opt_f) {
 			fprintf(stderr, "%s: error linking %s -> %s: %s\n", _g.exename,
 				argv[optind], linkpath, strerror(errno));
+			if (_g.dest_isdir)
+				free(linkpath);
 			return EXIT_FAILURE;
 		}
 
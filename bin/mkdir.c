@@ -25,6 +25,7 @@ int main(int argc, char *argv[])
 {
 	int opt, retv = 0;
 
+	memset(&_g, 0, sizeof(_g));
 	_g.exename = argv[0];
 	while ((opt = getopt(argc, argv, "p")) != -1)
 		switch (opt) {
@@ -55,6 +56,7 @@ int main(int argc, char *argv[])
 				}
 				strncat(cumul_path, "/", PATH_MAX-strlen(cumul_path));
 			}
+			free(cumul_path);
 		} else if (mkdir(argv[optind], 0750) == -1) {
 			fprintf(stderr, "%s: mkdir failed for '%s': %s\n", _g.exename, argv[optind], strerror(errno));
 			retv |= EXIT_FAILURE;
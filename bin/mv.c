@@ -1,12 +1,18 @@
 
 #define	_POSIX_SOURCE
+#if defined __linux__
+#define	_GNU_SOURCE	/* copy_file_range */
+#endif
 
+#include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
@@ -18,10 +24,22 @@ static struct {
 	char *exename,
 	     *usage_str;
 	int opt_prompt,
-	    opt_v;
+	    opt_n,	/* -n: no-clobber */
+	    opt_v,
+	    opt_from0,	/* --from0: NUL-separated SRC operands on stdin */
+	    opt_exchange;	/* --exchange: atomically swap two paths */
 	char *target;
+	int target_isdir,
+	    target_fd;	/* AT_FDCWD, or the target directory */
+	char target_path[PATH_MAX+1];	/* diagnostics */
+
+	/* cross-device move accounting */
+	unsigned long nfiles, nbytes;
 } _g;
 
+/* chunk size of cross-device data copies */
+#define	COPY_BUFSIZ	(1024*1024)
+
 
 static int file_isdir(const char *pathname)
 {
@@ -32,7 +50,309 @@ static int file_isdir(const char *pathname)
 		return S_ISDIR(sbuf.st_mode);
 }
 
-void usage(char *msg, ...)
+/**
+ *  formats error message and append strerror(errno) */
+static int ERR(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "%s: ", _g.exename);
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, ": %s\n", strerror(errno));
+	va_end(ap);
+	return EXIT_FAILURE;
+}
+
+/* read(2)/write(2) copy, handling short writes */
+static int copy_data_rw(int sfd, int dfd)
+{
+	static char *buf;
+	ssize_t nread, nwritten, retv;
+
+	if (buf == NULL)
+		assert(buf = malloc(COPY_BUFSIZ));
+	while ((nread = read(sfd, buf, COPY_BUFSIZ)) != 0) {
+		if (nread == -1 && errno == EINTR)
+			continue;
+		else if (nread == -1)
+			return -1;
+		for (nwritten = 0; nwritten < nread; nwritten += retv)
+			if ((retv = write(dfd, buf+nwritten, nread-nwritten)) == -1) {
+				if (errno != EINTR && errno != EAGAIN)
+					return -1;
+				retv = 0;
+			}
+		_g.nbytes += nread;
+	}
+	return 0;
+}
+
+/**
+ *  Copy file data in-kernel where possible: copy_file_range() lets the
+ *  filesystem(s) move the data without a round trip through user space,
+ *  falling back to a large-buffer read/write loop from the current file
+ *  offsets when the kernel refuses the pair of files */
+static int copy_data(int sfd, int dfd)
+{
+#if defined __linux__
+	ssize_t n;
+	while ((n = copy_file_range(sfd, NULL, dfd, NULL, COPY_BUFSIZ, 0)) > 0)
+		_g.nbytes += n;
+	if (n == 0)
+		return 0;
+	if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+		return -1;
+#endif
+	return copy_data_rw(sfd, dfd);
+}
+
+/* carry ownership, permissions and timestamps of SSB over to NAME */
+static void copy_metadata(const struct stat *ssb, int dirfd, const char *name)
+{
+	struct timespec times[2];
+	int flags = S_ISLNK(ssb->st_mode) ? AT_SYMLINK_NOFOLLOW : 0;
+
+	times[0] = ssb->st_atim;
+	times[1] = ssb->st_mtim;
+	/* chown failure (EPERM as non-root) is not fatal */
+	fchownat(dirfd, name, ssb->st_uid, ssb->st_gid, flags);
+	if (!S_ISLNK(ssb->st_mode))
+		fchmodat(dirfd, name, ssb->st_mode & 07777, 0);
+	utimensat(dirfd, name, times, flags);
+}
+
+/**
+ *  Copy SNAME (relative to SDIRFD) as DNAME (relative to DDIRFD) along with
+ *  its metadata, descending into directories.  Stops at the first error as
+ *  a partial copy must not result in the source being removed */
+static int copy_tree(int sdirfd, const char *sname, int ddirfd, const char *dname)
+{
+	struct stat ssb;
+	int sfd, dfd, retv = EXIT_SUCCESS;
+
+	if (fstatat(sdirfd, sname, &ssb, AT_SYMLINK_NOFOLLOW) == -1)
+		return ERR("stat '%s'", sname);
+
+	if (S_ISDIR(ssb.st_mode)) {
+		struct dirent *dent;
+		DIR *dir;
+
+		if (mkdirat(ddirfd, dname, S_IRWXU) == -1)
+			return ERR("mkdir '%s'", dname);
+		if ((sfd = openat(sdirfd, sname, O_RDONLY | O_DIRECTORY)) == -1)
+			return ERR("open '%s'", sname);
+		if ((dfd = openat(ddirfd, dname, O_RDONLY | O_DIRECTORY)) == -1) {
+			close(sfd);
+			return ERR("open '%s'", dname);
+		}
+		if ((dir = fdopendir(sfd)) == NULL) {
+			close(sfd);
+			close(dfd);
+			return ERR("opendir '%s'", sname);
+		}
+		while (retv == EXIT_SUCCESS && (errno = 0, dent = readdir(dir)) != NULL)
+			if (!(dent->d_name[0] == '.' && (dent->d_name[1] == '\0'
+				|| dent->d_name[1] == '.' && dent->d_name[2] == '\0')))
+				retv = copy_tree(sfd, dent->d_name, dfd, dent->d_name);
+		if (retv == EXIT_SUCCESS && errno != 0)
+			retv = ERR("readdir '%s'", sname);
+		closedir(dir);
+		/* timestamps last, filling the directory updated them */
+		copy_metadata(&ssb, dfd, ".");
+		close(dfd);
+		return retv;
+	} else if (S_ISREG(ssb.st_mode)) {
+		if ((sfd = openat(sdirfd, sname, O_RDONLY)) == -1)
+			return ERR("open '%s'", sname);
+		if ((dfd = openat(ddirfd, dname, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR)) == -1) {
+			close(sfd);
+			return ERR("creat '%s'", dname);
+		}
+		if (copy_data(sfd, dfd) == -1)
+			retv = ERR("copy '%s'", sname);
+		close(sfd);
+		if (close(dfd) == -1 && retv == EXIT_SUCCESS)
+			retv = ERR("close '%s'", dname);
+	} else if (S_ISLNK(ssb.st_mode)) {
+		char buf[PATH_MAX];
+		ssize_t nread;
+		if ((nread = readlinkat(sdirfd, sname, buf, sizeof(buf)-1)) == -1)
+			return ERR("readlink '%s'", sname);
+		buf[nread] = '\0';
+		if (symlinkat(buf, ddirfd, dname) == -1)
+			return ERR("symlink '%s'", dname);
+	} else if (S_ISFIFO(ssb.st_mode)) {
+		if (mkfifoat(ddirfd, dname, ssb.st_mode & 07777) == -1)
+			return ERR("mkfifo '%s'", dname);
+	} else if (mknodat(ddirfd, dname, ssb.st_mode, ssb.st_rdev) == -1)
+		return ERR("mknod '%s'", dname);
+
+	if (retv == EXIT_SUCCESS) {
+		copy_metadata(&ssb, ddirfd, dname);
+		_g.nfiles++;
+	}
+	return retv;
+}
+
+/* depth-first removal of NAME relative to DIRFD */
+static int remove_tree(int dirfd, const char *name)
+{
+	struct stat sbuf;
+	struct dirent *dent;
+	DIR *dir;
+	int fd, retv = EXIT_SUCCESS;
+
+	if (fstatat(dirfd, name, &sbuf, AT_SYMLINK_NOFOLLOW) == -1)
+		return ERR("stat '%s'", name);
+	if (!S_ISDIR(sbuf.st_mode))
+		return unlinkat(dirfd, name, 0) == -1 ? ERR("unlink '%s'", name) : EXIT_SUCCESS;
+
+	if ((fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY)) == -1)
+		return ERR("open '%s'", name);
+	if ((dir = fdopendir(fd)) == NULL) {
+		close(fd);
+		return ERR("opendir '%s'", name);
+	}
+	while ((dent = readdir(dir)) != NULL)
+		if (!(dent->d_name[0] == '.' && (dent->d_name[1] == '\0'
+			|| dent->d_name[1] == '.' && dent->d_name[2] == '\0')))
+			retv |= remove_tree(fd, dent->d_name);
+	closedir(dir);
+	if (retv == EXIT_SUCCESS && unlinkat(dirfd, name, AT_REMOVEDIR) == -1)
+		retv = ERR("rmdir '%s'", name);
+	return retv;
+}
+
+/**
+ *  rename(2) fallback for EXDEV: copy SRC into a temporary sibling of DNAME
+ *  (relative to DDIRFD), rename that into place (so the target never shows
+ *  a partial tree) and only then remove SRC */
+static int move_across(const char *src, int ddirfd, const char *dname)
+{
+	struct stat sbuf;
+	char *tmpname;
+	int retv;
+
+	assert(tmpname = malloc(strlen(dname) + 32));
+	sprintf(tmpname, "%s.mv%lu", dname, (unsigned long)getpid());
+
+	if (fstatat(ddirfd, tmpname, &sbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+		errno = EEXIST;
+		retv = ERR("temporary '%s'", tmpname);
+	} else if ((retv = copy_tree(AT_FDCWD, src, ddirfd, tmpname)) != EXIT_SUCCESS)
+		remove_tree(ddirfd, tmpname);
+	else if (renameat(ddirfd, tmpname, ddirfd, dname) == -1) {
+		retv = ERR("rename of %s -> %s failed", tmpname, dname);
+		remove_tree(ddirfd, tmpname);
+	} else
+		retv = remove_tree(AT_FDCWD, src);
+
+	free(tmpname);
+	return retv;
+}
+
+static int confirm_overwrite(const char *pathname)
+{
+	char *answer = NULL;
+	size_t len = 0;
+	if (!isatty(STDIN_FILENO))
+		return 0;
+	do {
+		ssize_t nread;
+		fprintf(stdout, "%s: confirm overwriting '%s'? (y/N): ", _g.exename, pathname);
+		fflush(stdout);
+		if ((nread = getline(&answer, &len, stdin)) == -1 || nread < 2)
+			return 0;
+		if (nread > 2 || nread == 2 && answer[1] != '\n')
+			continue;
+		else if (*answer == 'y' || *answer == 'Y')
+			return 1;
+		else if (*answer == 'n' || *answer == 'N')
+			return 0;
+	} while(1);
+}
+
+/**
+ *  renameat(2) failing with EEXIST rather than replacing NEWNAME; atomic
+ *  with renameat2(RENAME_NOREPLACE), otherwise (or when the filesystem
+ *  does not support the flag) a check-then-rename */
+static int rename_noreplace(int olddirfd, const char *oldpath, int newdirfd, const char *newname)
+{
+	struct stat sbuf;
+#if defined __linux__ && defined RENAME_NOREPLACE
+	if (renameat2(olddirfd, oldpath, newdirfd, newname, RENAME_NOREPLACE) == 0)
+		return 0;
+	else if (errno != EINVAL && errno != ENOSYS)
+		return -1;
+#endif
+	if (fstatat(newdirfd, newname, &sbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+		errno = EEXIST;
+		return -1;
+	}
+	return renameat(olddirfd, oldpath, newdirfd, newname);
+}
+
+/**
+ *  Move SRC to the target, i.e. _g.target itself or SRC's basename within
+ *  the target directory which is opened once and referred to by _g.target_fd */
+static int move_one(char *src)
+{
+	const char *name = _g.target_isdir ? basename(src) : _g.target;
+	int noreplace = _g.opt_prompt || _g.opt_n, rc;
+
+	if (_g.target_isdir)
+		snprintf(_g.target_path, sizeof(_g.target_path), "%s/%s", _g.target, name);
+	else
+		snprintf(_g.target_path, sizeof(_g.target_path), "%s", _g.target);
+
+	rc = noreplace ? rename_noreplace(AT_FDCWD, src, _g.target_fd, name)
+		: renameat(AT_FDCWD, src, _g.target_fd, name);
+	if (rc == -1 && errno == EXDEV && noreplace) {
+		struct stat sbuf;
+		if (fstatat(_g.target_fd, name, &sbuf, AT_SYMLINK_NOFOLLOW) == 0)
+			errno = EEXIST;
+		else
+			errno = EXDEV;
+	}
+	if (rc == -1 && errno == EEXIST && noreplace) {
+		if (_g.opt_n || !confirm_overwrite(_g.target_path))
+			return EXIT_SUCCESS;
+		rc = renameat(AT_FDCWD, src, _g.target_fd, name);
+	}
+
+	if (_g.opt_v)
+		printf("%s -> %s\n", src, _g.target_path);
+	if (rc == -1 && errno == EXDEV)
+		return move_across(src, _g.target_fd, name);
+	else if (rc == -1) {
+		fprintf(stderr, "%s: rename of %s -> %s failed: %s\n", _g.exename, src, _g.target_path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ *  --exchange: swap A and B in a single renameat2(RENAME_EXCHANGE), both
+ *  of which must exist, on the same filesystem */
+static int exchange(const char *a, const char *b)
+{
+#if defined __linux__ && defined RENAME_EXCHANGE
+	if (renameat2(AT_FDCWD, a, AT_FDCWD, b, RENAME_EXCHANGE) == 0) {
+		if (_g.opt_v)
+			printf("%s <-> %s\n", a, b);
+		return EXIT_SUCCESS;
+	}
+	/* EINVAL is either an unsupporting filesystem or a real usage error,
+	 * e.g. one path inside the other: report it as is */
+	if (errno == ENOSYS)
+		errno = EOPNOTSUPP;
+#else
+	errno = EOPNOTSUPP;
+#endif
+	return ERR("exchange of %s <-> %s failed", a, b);
+}
+
+static void usage(char *msg, ...)
 {
 	if (msg) {
 		va_list ap;
@@ -47,52 +367,70 @@ void usage(char *msg, ...)
 
 int main(int argc, char *argv[])
 {
+	static struct option longopts[] = {
+		{ "from0", no_argument, NULL, '0' },
+		{ "exchange", no_argument, NULL, 'x' },
+		{ NULL, 0, NULL, 0 }
+	};
 	int opt, retv=EXIT_SUCCESS;
-	
+
+	memset(&_g, 0, sizeof(_g));
 	_g.exename = argv[0];
-	_g.usage_str = "[-fiv] SRC... TARGET";
-	while ((opt = getopt(argc, argv, "v")) != -1)
+	_g.usage_str = "[-finv] SRC... TARGET\n"
+		       "\t[-finv] --from0 TARGET < NUL-separated SRC list\n"
+		       "\t[-v] --exchange PATH1 PATH2";
+	while ((opt = getopt_long(argc, argv, "finv", longopts, NULL)) != -1)
 		switch (opt) {
-		case 'i': _g.opt_prompt = 1; break;
-		case 'f': _g.opt_prompt = 0; break;
+		case 'i': _g.opt_prompt = 1; _g.opt_n = 0; break;
+		case 'f': _g.opt_prompt = 0; _g.opt_n = 0; break;
+		case 'n': _g.opt_n = 1; _g.opt_prompt = 0; break;
 		case 'v': _g.opt_v = 1; break;
+		case '0': _g.opt_from0 = 1; break;
+		case 'x': _g.opt_exchange = 1; break;
 		default:
 			usage(NULL);
 		}
 
-	if (argc-optind < 2)
+	if (argc-optind < (_g.opt_from0 ? 1 : 2))
 		usage(NULL);
 
+	if (_g.opt_exchange) {
+		if (argc-optind != 2 || _g.opt_from0)
+			usage("--exchange takes exactly two operands\n");
+		return exchange(argv[optind], argv[optind+1]);
+	}
+
 	/* is last arg a directory */
 	_g.target = argv[argc-1];
+	_g.target_isdir = file_isdir(_g.target);
 
-	if (argc-optind > 2 && !file_isdir(_g.target))
+	if ((argc-optind > 2 || _g.opt_from0) && !_g.target_isdir)
 		usage("move with multiple source operands require a target directory\n");
 
-	/* opt is # of non-option args (file operands) */
-	for (opt=argc-optind ; optind < argc-1; optind++) {
-		struct stat sbuf;
-		char *target_path;
+	_g.target_fd = AT_FDCWD;
+	if (_g.target_isdir && (_g.target_fd = open(_g.target, O_RDONLY | O_DIRECTORY)) == -1)
+		return ERR("open '%s'", _g.target);
 
-		if (stat(argv[optind], &sbuf) == -1) {
-			fprintf(stderr, "%s: unable to stat source operand '%s': %s\n", _g.exename, argv[optind], strerror(errno));
-			retv |= EXIT_FAILURE;
-			continue;
-		}
+	for ( ; optind < argc-1; optind++)
+		retv |= move_one(argv[optind]);
 
-		target_path = opt > 2 || file_isdir(_g.target) ? malloc(PATH_MAX+1) : _g.target;
-		if (target_path != _g.target)
-			snprintf(target_path, PATH_MAX+1, "%s/%s", _g.target, basename(argv[optind]));
-		if (_g.opt_v)
-			printf("%s -> %s\n", argv[optind], target_path);
-		if (rename(argv[optind], target_path) == -1) {
-			fprintf(stderr, "%s: rename of %s -> %s failed: %s\n", _g.exename, argv[optind], target_path, strerror(errno));
-			retv |= EXIT_FAILURE;
-		}
-		if (target_path != _g.target)
-			free(target_path);
+	if (_g.opt_from0) {
+		char *src = NULL;
+		size_t n = 0;
+		ssize_t nread;
+		while ((nread = getdelim(&src, &n, '\0', stdin)) != -1)
+			if (*src != '\0')
+				retv |= move_one(src);
+		if (ferror(stdin))
+			retv |= ERR("error reading operands from <stdin>");
+		free(src);
 	}
 
+	/* always, on stderr: stdout stays quiet without -v */
+	if (_g.nfiles > 0)
+		fprintf(stderr, "%s: moved %lu files (%lu bytes) across devices\n", _g.exename, _g.nfiles, _g.nbytes);
+
+	if (_g.target_fd != AT_FDCWD)
+		close(_g.target_fd);
 	return retv;
 }
-
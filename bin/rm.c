@@ -1,16 +1,28 @@
 
 #define	_POSIX_SOURCE
+#if defined __linux__
+#define	_DEFAULT_SOURCE	/* struct dirent d_type */
+#endif
 
+#include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <ftw.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#if defined __linux__
+#include <sys/syscall.h>
+#endif
 
 
 static struct {
@@ -18,7 +30,10 @@ static struct {
 	     *usage_str;
 	int opt_prompt,		/* force/prompt */
 	    opt_r, opt_R,		/* recursive remove */
-	    opt_v;
+	    opt_v,
+	    opt_async;		/* --async: trash now, reap in the background */
+	char **trashed;		/* --async: batch directories to reap */
+	size_t ntrashed;
 } _g;
 
 
@@ -69,7 +84,7 @@ static int confirm_remove(const char *pathname)
 	} while(1);
 }
 
-int unlink_path(const char *pathname, const struct stat *sbuf)
+static int unlink_path(const char *pathname, const struct stat *sbuf)
 {
 	if (S_ISDIR(sbuf->st_mode)) {
 		if (_g.opt_v)
@@ -86,43 +101,389 @@ int unlink_path(const char *pathname, const struct stat *sbuf)
 	return EXIT_SUCCESS;
 }
 
-int do_ftw_rm(const char *fname, const struct stat *sbuf, int flag, struct FTW *ftwbuf)
+/*
+ *  Recursive removal engine: directories are walked with openat/fdopendir and
+ *  their entries unlinked with unlinkat() relative to the directory, so no
+ *  pathnames are built (nor limited by PATH_MAX) and no per-entry lstat() is
+ *  needed when readdir() reports the entry type.  Each directory found is
+ *  pushed on a shared work stack served by a pool of worker threads, and is
+ *  removed by whichever thread completes its last pending subdirectory.
+ */
+struct rm_dir {
+	struct rm_dir *parent;	/* NULL for an operand */
+	char *name;		/* relative to the parent directory */
+	char *path;		/* diagnostics */
+	DIR *dir;		/* open until the directory is empty */
+	unsigned long pending;	/* own scan + subdirectories not yet removed */
+	int failed;		/* some entry was left, don't bother with rmdir */
+	struct rm_dir *next;	/* work stack link */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rm_dir *stack;
+	unsigned nbusy;		/* workers scanning a directory */
+	int retv;
+} _rm = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* upper bound on worker threads, unlink(2) throughput flattens out quickly */
+#define	RM_MAXTHREADS	8
+
+static char *path_join(const char *dir, const char *name)
+{
+	char *p;
+	assert(p = malloc(strlen(dir) + strlen(name) + 2));
+	sprintf(p, "%s/%s", dir, name);
+	return p;
+}
+
+/* error reporting follows unlink_path(): quiet unless prompting */
+static void rm_fail(struct rm_dir *d, const char *what, const char *path)
+{
+	pthread_mutex_lock(&_rm.lock);
+	if (_g.opt_prompt)
+		_rm.retv |= ERR("%s '%s'", what, path);
+	if (d)
+		d->failed = 1;
+	pthread_mutex_unlock(&_rm.lock);
+}
+
+static void rm_push(struct rm_dir *parent, const char *name, const char *path)
 {
-	unlink_path(fname, sbuf);
-	return 0;
+	struct rm_dir *d = calloc(1, sizeof(*d));
+	assert(d != NULL);
+	assert(d->name = strdup(name));
+	d->path = parent ? path_join(parent->path, name) : strdup(path);
+	d->parent = parent;
+	d->pending = 1;
+
+	pthread_mutex_lock(&_rm.lock);
+	if (parent)
+		parent->pending++;
+	d->next = _rm.stack;
+	_rm.stack = d;
+	pthread_cond_signal(&_rm.cond);
+	pthread_mutex_unlock(&_rm.lock);
+}
+
+/**
+ *  Drop one pending reference of D, removing it (and in turn releasing its
+ *  parent) once the scan and all subdirectories are done */
+static void rm_release(struct rm_dir *d)
+{
+	while (d) {
+		struct rm_dir *parent = d->parent;
+		int pfd, failed;
+
+		pthread_mutex_lock(&_rm.lock);
+		failed = d->failed;
+		if (--d->pending > 0) {
+			pthread_mutex_unlock(&_rm.lock);
+			return;
+		}
+		if (failed && parent)
+			parent->failed = 1;
+		pthread_mutex_unlock(&_rm.lock);
+
+		if (d->dir)
+			closedir(d->dir);
+		pfd = parent ? dirfd(parent->dir) : AT_FDCWD;
+		if (!failed) {
+			if (_g.opt_v)
+				printf("%s: removing directory %s\n", _g.exename, d->path);
+			if ((!_g.opt_prompt || confirm_remove(d->path)) && unlinkat(pfd, d->name, AT_REMOVEDIR) == -1)
+				rm_fail(parent, "rmdir", d->path);
+		}
+		free(d->name);
+		free(d->path);
+		free(d);
+		d = parent;
+	}
 }
 
-int do_rm(char *const *pathnamev, size_t nargs)
+static void rm_scan(struct rm_dir *d)
+{
+	struct dirent *dent;
+	int pfd = d->parent ? dirfd(d->parent->dir) : AT_FDCWD, fd;
+
+	fd = openat(pfd, d->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1 || (d->dir = fdopendir(fd)) == NULL) {
+		rm_fail(d, "open", d->path);
+		if (fd != -1)
+			close(fd);
+		rm_release(d);
+		return;
+	}
+
+	while ((dent = readdir(d->dir)) != NULL) {
+		const char *name = dent->d_name;
+		int isdir;
+		if (name[0] == '.' && (name[1] == '\0' || name[1] == '.' && name[2] == '\0'))
+			continue;
+#if defined DT_UNKNOWN
+		if (dent->d_type != DT_UNKNOWN)
+			isdir = dent->d_type == DT_DIR;
+		else
+#endif
+		{
+			struct stat sbuf;
+			isdir = fstatat(fd, name, &sbuf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(sbuf.st_mode);
+		}
+
+		if (isdir)
+			rm_push(d, name, NULL);
+		else if (_g.opt_v || _g.opt_prompt) {
+			char *path = path_join(d->path, name);
+			if (_g.opt_v)
+				printf("%s: removing '%s'\n", _g.exename, path);
+			if ((!_g.opt_prompt || confirm_remove(path)) && unlinkat(fd, name, 0) == -1)
+				rm_fail(d, "unlink", path);
+			free(path);
+		} else if (unlinkat(fd, name, 0) == -1)
+			rm_fail(d, "unlink", name);
+	}
+	rm_release(d);
+}
+
+static void *rm_worker(void *arg)
+{
+	struct rm_dir *d;
+
+	pthread_mutex_lock(&_rm.lock);
+	for (;;) {
+		while (_rm.stack == NULL && _rm.nbusy > 0)
+			pthread_cond_wait(&_rm.cond, &_rm.lock);
+		if ((d = _rm.stack) == NULL)
+			break;
+		_rm.stack = d->next;
+		_rm.nbusy++;
+		pthread_mutex_unlock(&_rm.lock);
+
+		rm_scan(d);
+
+		pthread_mutex_lock(&_rm.lock);
+		if (--_rm.nbusy == 0 && _rm.stack == NULL)
+			pthread_cond_broadcast(&_rm.cond);
+	}
+	pthread_mutex_unlock(&_rm.lock);
+	return arg;
+}
+
+/* drain the work stack, in parallel unless prompting for each entry */
+static int rm_run(void)
+{
+	pthread_t tids[RM_MAXTHREADS];
+	struct rlimit rlim, saved_rlim;
+	int raised = 0;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned i, nthreads = _g.opt_prompt || ncpu < 1 ? 1 : ncpu > RM_MAXTHREADS ? RM_MAXTHREADS : ncpu;
+
+	/* every directory on the way down is held open */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+		saved_rlim = rlim;
+		rlim.rlim_cur = rlim.rlim_max;
+		raised = setrlimit(RLIMIT_NOFILE, &rlim) == 0;
+	}
+
+	/* the calling thread is worker #0 */
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, rm_worker, NULL) != 0)
+			break;
+	nthreads = i;
+	rm_worker(NULL);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	/* not to be inherited by what runs next, when a shell builtin */
+	if (raised)
+		setrlimit(RLIMIT_NOFILE, &saved_rlim);
+	return _rm.retv;
+}
+
+/*
+ *  --async: directory operands are renamed into a hidden trash directory
+ *  next to them (hence on the same filesystem, and reused by subsequent
+ *  invocations) and a detached, low priority child runs the removal engine
+ *  over them once the invoking rm has returned.  The reaper takes every
+ *  batch in the trash directories it was handed, including those left
+ *  behind by an earlier reaper that was killed.  A trash directory is only
+ *  used if it is ours and writable by no one else: under a shared parent
+ *  like /tmp, anyone else could take batches out of it.
+ */
+#define	TRASH_DIRNAME	".rm-trash"
+
+static int trash_is_private(const char *trash)
+{
+	struct stat sbuf;
+
+	return lstat(trash, &sbuf) == 0 && S_ISDIR(sbuf.st_mode)
+		&& sbuf.st_uid == geteuid() && (sbuf.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/**
+ *  Move PATHNAME into a new, uniquely named TRASH_DIRNAME/XXXXXX: the empty
+ *  directory made by mkdtemp() is atomically replaced by the rename */
+static int rm_trash(const char *pathname)
+{
+	char *dir = strdup(pathname), *trash, *batch;
+	int retv = EXIT_SUCCESS;
+
+	assert(dir != NULL);
+	trash = path_join(dirname(dir), TRASH_DIRNAME);
+	batch = path_join(trash, "XXXXXX");
+	if (mkdir(trash, S_IRWXU) == -1 && errno != EEXIST || mkdtemp(batch) == NULL) {
+		retv = ERR("unable to create trash directory '%s'", trash);
+		free(batch);
+	} else if (!trash_is_private(trash)) {
+		errno = EPERM;
+		retv = ERR("refusing to use trash directory '%s'", trash);
+		rmdir(batch);
+		free(batch);
+	} else if (rename(pathname, batch) == -1) {
+		/* e.g. a mount point, remove it the synchronous way */
+		rmdir(batch);
+		free(batch);
+		rm_push(NULL, pathname, pathname);
+	} else {
+		if (_g.opt_v)
+			printf("%s: removing directory %s (async)\n", _g.exename, pathname);
+		assert(_g.trashed = realloc(_g.trashed, sizeof(char*) * (_g.ntrashed+1)));
+		_g.trashed[_g.ntrashed++] = batch;
+	}
+	free(trash);
+	free(dir);
+	return retv;
+}
+
+/* queue every batch of TRASH, a mkdtemp() directory unless tampered with */
+static void rm_push_batches(const char *trash)
+{
+	struct dirent *dent;
+	DIR *dir;
+
+	if (!trash_is_private(trash) || (dir = opendir(trash)) == NULL)
+		return;
+	while ((dent = readdir(dir)) != NULL)
+		if (strlen(dent->d_name) == 6 && dent->d_name[0] != '.') {
+			char *batch = path_join(trash, dent->d_name);
+			rm_push(NULL, batch, batch);
+			free(batch);
+		}
+	closedir(dir);
+}
+
+/* fork a detached (double-forked, own session) reaper for _g.trashed */
+static int rm_reap_detached(void)
+{
+	pid_t pid;
+	size_t i;
+	int fd;
+
+	if ((pid = fork()) == -1)
+		return ERR("fork");
+	else if (pid > 0)
+		return waitpid(pid, NULL, 0) == -1 ? ERR("waitpid") : EXIT_SUCCESS;
+
+	setsid();
+	if (fork() != 0)
+		_exit(EXIT_SUCCESS);
+
+	if ((fd = open("/dev/null", O_RDWR)) != -1) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+	nice(19);
+#if defined __linux__ && defined SYS_ioprio_set
+	/* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE */
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+	_g.opt_prompt = _g.opt_v = 0;
+	for (i = 0; i < _g.ntrashed; i++) {
+		char *trash = dirname(_g.trashed[i]);
+		size_t j;
+		/* each trash directory once */
+		for (j = 0; j < i && strcmp(_g.trashed[j], trash); j++)
+			;
+		if (j == i)
+			rm_push_batches(trash);
+	}
+	_exit(rm_run());
+}
+
+/* whether the last component of PATHNAME, trailing slashes aside, is . or .. */
+static int is_dot_or_dotdot(const char *pathname)
+{
+	size_t len = strlen(pathname), blen;
+	const char *base;
+
+	while (len > 1 && pathname[len-1] == '/')
+		len--;
+	for (base = pathname + len; base > pathname && base[-1] != '/'; base--)
+		;
+	blen = len - (base - pathname);
+	return (blen == 1 || blen == 2) && !strncmp(base, "..", blen);
+}
+
+static int do_rm(char *const *pathnamev, size_t nargs)
 {
 	struct stat lsbuf;
 	int retv = 0;
 	size_t i;
 
 	for (i=0; i < nargs; i++) {
-		if (lstat(pathnamev[i], &lsbuf) == -1 && _g.opt_prompt)
-			retv |= ERR("stat '%s'", pathnamev[i]);
-		else if (!S_ISDIR(lsbuf.st_mode))
+		if (lstat(pathnamev[i], &lsbuf) == -1) {
+			if (_g.opt_prompt)
+				retv |= ERR("stat '%s'", pathnamev[i]);
+		} else if (!S_ISDIR(lsbuf.st_mode))
 			retv |= unlink_path(pathnamev[i], &lsbuf);
-		else
-			retv |= nftw(pathnamev[i], do_ftw_rm, 16, FTW_DEPTH | FTW_PHYS);
+		else if (!_g.opt_r) {
+			errno = EISDIR;
+			retv |= ERR("cannot remove '%s'", pathnamev[i]);
+		} else if (is_dot_or_dotdot(pathnamev[i])) {
+			fprintf(stderr, "%s: refusing to remove '%s'\n", _g.exename, pathnamev[i]);
+			retv |= EXIT_FAILURE;
+		} else if (_g.opt_async) {
+			if (!_g.opt_prompt || confirm_remove(pathnamev[i]))
+				retv |= rm_trash(pathnamev[i]);
+		} else
+			rm_push(NULL, pathnamev[i], pathnamev[i]);
 	}
 
+	if (_rm.stack != NULL)
+		retv |= rm_run();
+	if (_g.ntrashed > 0)
+		retv |= rm_reap_detached();
+	for (i = 0; i < _g.ntrashed; i++)
+		free(_g.trashed[i]);
+	free(_g.trashed);
 	return retv;
 }
 
 int main(int argc, char *argv[])
 {
+	static struct option longopts[] = {
+		{ "async", no_argument, NULL, 'a' },
+		{ NULL, 0, NULL, 0 }
+	};
 	int opt, retv=EXIT_SUCCESS;
 	
+	memset(&_g, 0, sizeof(_g));
+	_rm.stack = NULL;
+	_rm.nbusy = 0;
+	_rm.retv = 0;
 	_g.exename = argv[0];
-	_g.usage_str = "[-if(Rr)v] FILE...";
+	_g.usage_str = "[-if(Rr)v] [--async] FILE...";
 	_g.opt_prompt = isatty(STDIN_FILENO);
-	while ((opt = getopt(argc, argv, "ifvRr")) != -1) {
+	while ((opt = getopt_long(argc, argv, "ifvRr", longopts, NULL)) != -1) {
 		switch (opt) {
 		case 'i': _g.opt_prompt = 1; break;
 		case 'f': _g.opt_prompt = 0; break;
 		case 'r': case 'R': _g.opt_r = 1; break;
 		case 'v': _g.opt_v = 1; break;
+		case 'a': _g.opt_async = 1; break;
 		default:
 			exit(usage(NULL));
 		}
@@ -1,121 +1,907 @@
+#if defined __linux__
+#define	_GNU_SOURCE	/* pipe2 */
+#endif
+
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+extern char **environ;
+
 static const char *PS1 = NULL;
 static void prompt() {
 	fprintf(stdout, "%s", PS1);
 }
 
-/** Whitespace trimming and compaction */
-char *cleanup_line(char *line) {
-	size_t si, di, len = strlen(line);
-	char *newline = (char*)malloc(len + 1);
+/* a simple command of a pipeline */
+struct command {
+	int argc;
+	char **argv;		/* NULL terminated */
+	char *in, *out;		/* < and > or >> files */
+	int append;
+	const char *path;	/* resolved command */
+};
+
+enum { T_END, T_WORD, T_PIPE, T_AMP, T_IN, T_OUT, T_APPEND };
+
+/** Next token at *PP, a blank separated word (strdup'd to *WORD) or an operator */
+static int next_token(char **pp, char **word) {
+	char *p = *pp, *start;
+
+	while (isspace((unsigned char)*p))
+		p++;
+	*pp = p + 1;
+	switch (*p) {
+	case '\0': *pp = p; return T_END;
+	case '|': return T_PIPE;
+	case '&': return T_AMP;
+	case '<': return T_IN;
+	case '>':
+		if (p[1] != '>')
+			return T_OUT;
+		*pp = p + 2;
+		return T_APPEND;
+	}
+	for (start = p; *p && !isspace((unsigned char)*p) && !strchr("|&<>", *p); p++)
+		;
+	assert(*word = (char*)malloc(p - start + 1));
+	memcpy(*word, start, p - start);
+	(*word)[p - start] = '\0';
+	*pp = p;
+	return T_WORD;
+}
+
+static void free_commands(struct command *cmds, int ncmds) {
+	int i, j;
+	for (i = 0; i < ncmds; i++) {
+		for (j = 0; j < cmds[i].argc; j++)
+			free(cmds[i].argv[j]);
+		free(cmds[i].argv);
+		free(cmds[i].in);
+		free(cmds[i].out);
+	}
+	free(cmds);
+}
+
+/**
+ *  Parses LINE into a pipeline: CMD [< FILE] [> FILE | >> FILE] [| CMD ...] [&]
+ *  @return {int} - # of commands in *CMDS, -1 on syntax errors */
+static int parse_line(char *line, struct command **cmds, int *is_detached) {
+	struct command *cmd;
+	char *word = NULL, **file;
+	int type, ncmds = 0;
 
-	for (si = di = 0; si < len; si++) {
-		if (isblank(line[si])) {
-			if (isblank(newline[di]))
+	*cmds = NULL;
+	*is_detached = 0;
+	for (;;) {
+		assert(*cmds = (struct command*)realloc(*cmds, sizeof(**cmds) * (ncmds + 1)));
+		cmd = &(*cmds)[ncmds++];
+		memset(cmd, 0, sizeof(*cmd));
+		assert(cmd->argv = (char**)malloc(sizeof(char*)));
+		while ((type = next_token(&line, &word)) != T_END && type != T_PIPE && type != T_AMP) {
+			if (type == T_WORD) {
+				assert(cmd->argv = (char**)realloc(cmd->argv, sizeof(char*) * (cmd->argc + 2)));
+				cmd->argv[cmd->argc++] = word;
 				continue;
+			}
+			file = type == T_IN ? &cmd->in : &cmd->out;
+			cmd->append = type == T_APPEND ? 1 : type == T_OUT ? 0 : cmd->append;
+			free(*file);
+			*file = NULL;
+			if (next_token(&line, file) != T_WORD) {
+				cmd->argv[cmd->argc] = NULL;
+				fprintf(stderr, "syntax error: missing file name after '%s'\n",
+						type == T_IN ? "<" : type == T_OUT ? ">" : ">>");
+				free_commands(*cmds, ncmds);
+				*cmds = NULL;
+				return -1;
+			}
+		}
+		cmd->argv[cmd->argc] = NULL;
+		if (type == T_AMP) {
+			*is_detached = 1;
+			if ((type = next_token(&line, &word)) != T_END) {
+				if (type == T_WORD)
+					free(word);
+				fprintf(stderr, "syntax error: '&' is only allowed at the end\n");
+				break;
+			}
+		}
+		if (cmd->argc == 0) {
+			/* an empty line is no error */
+			if (type == T_END && ncmds == 1 && !cmd->in && !cmd->out && !*is_detached)
+				ncmds = 0;
 			else
-				newline[di++] = line[si];
-		} else {
-			newline[di++] = line[si];
+				fprintf(stderr, "syntax error: empty command\n");
+			break;
+		}
+		if (type == T_END)
+			return ncmds;
+	}
+	free_commands(*cmds, ncmds ? ncmds : 1);
+	*cmds = NULL;
+	return ncmds ? -1 : 0;
+}
+
+/*
+ *  Command hash: the PATH search for a command name is done once, its
+ *  result is remembered until PATH changes or the remembered path fails
+ *  to execute (the spawn fails, or a forked command exits 127).
+ */
+#define	HASH_BUCKETS	64
+#define	DEFAULT_PATH	"/bin:/usr/bin"
+
+struct cmd_hash {
+	char *name, *path;
+	unsigned long hits;
+	struct cmd_hash *next;
+};
+
+static struct cmd_hash *cmd_table[HASH_BUCKETS];
+static char *hashed_PATH = NULL;	/* PATH the table was filled from */
+
+static struct cmd_hash **hash_bucket(const char *name) {
+	unsigned h = 0;
+	while (*name)
+		h = h * 31 + (unsigned char)*name++;
+	return &cmd_table[h % HASH_BUCKETS];
+}
+
+/** Forget NAME, or every command if NULL */
+static void hash_forget(const char *name) {
+	struct cmd_hash **pp, *e;
+	int i;
+
+	for (i = 0; i < HASH_BUCKETS; i++)
+		for (pp = &cmd_table[i]; (e = *pp) != NULL; ) {
+			if (name && strcmp(e->name, name)) {
+				pp = &e->next;
+				continue;
+			}
+			*pp = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
 		}
+}
+
+/** First executable regular file NAME in the PATH directories, malloc'd */
+static char *path_search(const char *name, const char *path) {
+	size_t nlen = strlen(name), dlen;
+	const char *dir, *end;
+	char *buf;
+	struct stat sbuf;
+
+	for (dir = path; ; dir = end + 1) {
+		if ((end = strchr(dir, ':')) == NULL)
+			end = dir + strlen(dir);
+		/* an empty entry is the current directory */
+		dlen = end > dir ? (size_t)(end - dir) : 1;
+		assert(buf = malloc(dlen + nlen + 2));
+		memcpy(buf, end > dir ? dir : ".", dlen);
+		buf[dlen] = '/';
+		memcpy(buf + dlen + 1, name, nlen + 1);
+		if (stat(buf, &sbuf) == 0 && S_ISREG(sbuf.st_mode) && access(buf, X_OK) == 0)
+			return buf;
+		free(buf);
+		if (*end == '\0')
+			return NULL;
+	}
+}
+
+/** The entry of NAME, which has no slash, searched in PATH if needed, NULL if not found */
+static struct cmd_hash *hash_enter(const char *name) {
+	const char *path = getenv("PATH");
+	struct cmd_hash **bucket, *e;
+	char *found;
+
+	if (path == NULL)
+		path = DEFAULT_PATH;
+	if (hashed_PATH == NULL || strcmp(hashed_PATH, path)) {
+		hash_forget(NULL);
+		free(hashed_PATH);
+		hashed_PATH = strdup(path);
 	}
 
-	if (newline[di-1] == '\n' || isblank(newline[di-1]))
-		di--;
-	newline[di] = '\0';
-	return newline;
+	for (e = *(bucket = hash_bucket(name)); e; e = e->next)
+		if (strcmp(e->name, name) == 0)
+			return e;
+	if ((found = path_search(name, path)) == NULL)
+		return NULL;
+	assert(e = (struct cmd_hash*)malloc(sizeof(*e)));
+	e->name = strdup(name);
+	e->path = found;
+	e->hits = 0;
+	e->next = *bucket;
+	return *bucket = e;
+}
+
+/**
+ *  Resolves command NAME to the path to execute, NULL if not found.
+ *  Names with a slash are taken as is */
+static const char *hash_lookup(const char *name) {
+	struct cmd_hash *e;
+
+	if (strchr(name, '/'))
+		return name;
+	if ((e = hash_enter(name)) == NULL)
+		return NULL;
+	e->hits++;
+	return e->path;
+}
+
+/** hash [-r] [NAME...]: list the remembered commands, forget them, or add NAMEs */
+static int builtin_hash(int argc, char * const *argv) {
+	struct cmd_hash *e;
+	int i, retv = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+		hash_forget(NULL);
+		argc--, argv++;
+	} else if (argc == 1) {
+		for (i = 0; i < HASH_BUCKETS; i++)
+			for (e = cmd_table[i]; e; e = e->next)
+				fprintf(stdout, "%4lu\t%s\n", e->hits, e->path);
+		return 0;
+	}
+	for (i = 1; i < argc; i++) {
+		if (strchr(argv[i], '/'))
+			continue;	/* never remembered */
+		hash_forget(argv[i]);
+		if (hash_enter(argv[i]) == NULL) {
+			fprintf(stderr, "hash: %s: not found\n", argv[i]);
+			retv = 1;
+		}
+	}
+	return retv;
 }
 
-void do_exec(int argc, char * const *argv, int is_detached) {
+/**
+ *  fork(2) fallback of launch(), for what posix_spawn can't do: running a
+ *  script without #! through /bin/sh, as execvp() would */
+static pid_t fork_exec(const struct command *cmd, int fd_in, int fd_out, int is_detached, pid_t pgid) {
 	pid_t pid;
 
 	if ((pid = fork()) == 0) { /* child */
 		if (!is_detached) {
 			signal(SIGINT, SIG_DFL);
 			signal(SIGQUIT, SIG_DFL);
+		} else
+			setpgid(0, pgid);
+		if (fd_in != -1)
+			dup2(fd_in, STDIN_FILENO);
+		if (fd_out != -1)
+			dup2(fd_out, STDOUT_FILENO);
+
+		execve(cmd->path, cmd->argv, environ);
+		if (errno == ENOEXEC) {
+			char **shargv;
+			assert(shargv = (char**)malloc(sizeof(char*) * (cmd->argc + 2)));
+			shargv[0] = "sh";
+			shargv[1] = (char*)cmd->path;
+			memcpy(shargv + 2, cmd->argv + 1, sizeof(char*) * cmd->argc);
+			execve("/bin/sh", shargv, environ);
 		}
+		fprintf(stderr, "execve(\"%s\") failed: %s\n", cmd->path, strerror(errno));
+		exit(127);
+	}
+	return pid;
+}
+
+/**
+ *  Starts CMD with posix_spawn(3), which needs neither a copy of the
+ *  shell's address space nor any code running in the child.  FD_IN and
+ *  FD_OUT (unless -1) become its stdin and stdout, through dup2 file
+ *  actions.  The signals the shell ignores are reset to their defaults
+ *  through the spawn attributes, except for detached commands, which are
+ *  put in process group PGID (0: a new one) instead.  SIGTSTP stays
+ *  ignored, as there is no job control.
+ *  @return {pid_t} - the child, or -1 with errno set */
+static pid_t launch(const struct command *cmd, int fd_in, int fd_out, int is_detached, pid_t pgid) {
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t actions;
+	sigset_t sigs;
+	pid_t pid;
+	int err;
+
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigs);
+	if (!is_detached) {
+		sigaddset(&sigs, SIGINT);
+		sigaddset(&sigs, SIGQUIT);
+	} else
+		posix_spawnattr_setpgroup(&attr, pgid);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+	sigemptyset(&sigs);
+	posix_spawnattr_setsigmask(&attr, &sigs);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK
+			| (is_detached ? POSIX_SPAWN_SETPGROUP : 0));
+	posix_spawn_file_actions_init(&actions);
+	if (fd_in != -1)
+		posix_spawn_file_actions_adddup2(&actions, fd_in, STDIN_FILENO);
+	if (fd_out != -1)
+		posix_spawn_file_actions_adddup2(&actions, fd_out, STDOUT_FILENO);
+	err = posix_spawn(&pid, cmd->path, &actions, &attr, cmd->argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if (err == ENOEXEC || err == ENOSYS)
+		return fork_exec(cmd, fd_in, fd_out, is_detached, pgid);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return pid;
+}
+
+/* pipe(2), close-on-exec: only the dup2'd copies are inherited */
+static int make_pipe(int fds[2]) {
+#if defined __linux__
+	return pipe2(fds, O_CLOEXEC);
+#else
+	if (pipe(fds) == -1)
+		return -1;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return 0;
+#endif
+}
+
+/**
+ *  Opens the redirection files of CMD, close-on-exec, -1 in *RD_IN and
+ *  *RD_OUT for none.  Failures are reported */
+static int open_redirections(const struct command *cmd, int *rd_in, int *rd_out) {
+	*rd_in = *rd_out = -1;
+	if (cmd->in && (*rd_in = open(cmd->in, O_RDONLY | O_CLOEXEC)) == -1) {
+		fprintf(stderr, "%s: %s\n", cmd->in, strerror(errno));
+		return -1;
+	}
+	if (cmd->out && (*rd_out = open(cmd->out, O_WRONLY | O_CREAT | O_CLOEXEC
+					| (cmd->append ? O_APPEND : O_TRUNC), 0666)) == -1) {
+		fprintf(stderr, "%s: %s\n", cmd->out, strerror(errno));
+		if (*rd_in != -1)
+			close(*rd_in);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ *  Starts stage CMD of a pipeline, reading FD_IN and writing FD_OUT unless
+ *  redirected.  Redirection files are opened by the shell, close-on-exec,
+ *  so that failures are its to report.
+ *  @return {pid_t} - the child, -1 on errors (reported) */
+static pid_t start_stage(struct command *cmd, int fd_in, int fd_out, int is_detached, pid_t pgid) {
+	int rd_in, rd_out;
+	pid_t pid = -1;
+
+	if (open_redirections(cmd, &rd_in, &rd_out) == -1)
+		return -1;
+	if (rd_in != -1)
+		fd_in = rd_in;
+	if (rd_out != -1)
+		fd_out = rd_out;
+
+	if ((pid = launch(cmd, fd_in, fd_out, is_detached, pgid)) == -1 && cmd->path != cmd->argv[0]
+			&& (errno == ENOENT || errno == ENOTDIR || errno == EACCES)) {
+		/* the remembered path is stale, search again */
+		hash_forget(cmd->argv[0]);
+		if ((cmd->path = hash_lookup(cmd->argv[0])) != NULL)
+			pid = launch(cmd, fd_in, fd_out, is_detached, pgid);
+		else
+			errno = ENOENT;
+	}
+	if (pid == -1)
+		fprintf(stderr, "%s: %s\n", cmd->argv[0], strerror(errno));
+	if (rd_in != -1)
+		close(rd_in);
+	if (rd_out != -1)
+		close(rd_out);
+	return pid;
+}
+
+/*
+ *  Job table: the detached pipelines still running, or finished but not
+ *  reported yet.  SIGCHLD writes to a self-pipe, which the shell drains
+ *  before reaping with waitpid(-1, WNOHANG) until nothing is left, and
+ *  polls when it has to block for a job.
+ */
+struct job {
+	pid_t pgid;
+	pid_t *pids;		/* of the stages, 0 once reaped, -1 never started */
+	int nprocs, nlive;
+	int status;		/* of the last stage */
+	char *name;
+};
+
+static struct job *jobs = NULL;
+static int njobs = 0, jobs_cap = 0;
+static int max_jobs = 0;	/* running detached jobs, 0 for no limit */
+static int chld_pipe[2] = { -1, -1 };
+
+static void on_sigchld(int sig) {
+	int saved_errno = errno;
+	(void)sig;
+	(void)!write(chld_pipe[1], "", 1);
+	errno = saved_errno;
+}
 
-		/* No job control */
-		signal(SIGTSTP, SIG_IGN);
+static void init_jobs() {
+	struct sigaction sa;
 
-		if (execvp(argv[0], argv) == -1) {
-			fprintf(stderr, "execvp(\"%s\") failed: %s\n", argv[0], strerror(errno));
-			exit(EXIT_FAILURE);
+	if (make_pipe(chld_pipe) == -1) {
+		fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fcntl(chld_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(chld_pipe[1], F_SETFL, O_NONBLOCK);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigchld;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+}
+
+/** The words of pipeline CMDS, for listing it */
+static char *job_name(const struct command *cmds, int ncmds) {
+	size_t len = 1;
+	char *name;
+	int i, j;
+
+	for (i = 0; i < ncmds; i++)
+		for (j = 0; j < cmds[i].argc; j++)
+			len += strlen(cmds[i].argv[j]) + 3;
+	assert(name = malloc(len));
+	name[0] = '\0';
+	for (i = 0; i < ncmds; i++)
+		for (j = 0; j < cmds[i].argc; j++) {
+			if (i > 0 || j > 0)
+				strcat(name, j == 0 ? " | " : " ");
+			strcat(name, cmds[i].argv[j]);
 		}
-	} else { /* parent */
-		if (is_detached) {
-			fprintf(stdout, "[%u] %s &\n", (unsigned)pid, argv[0]);
+	return name;
+}
+
+/** Adds the job PGID of stages PIDS, which it takes over */
+static void add_job(pid_t pgid, pid_t *pids, int nprocs, const struct command *cmds) {
+	struct job *job;
+	int i;
+
+	if (njobs == jobs_cap) {
+		jobs_cap = jobs_cap ? jobs_cap * 2 : 8;
+		assert(jobs = realloc(jobs, sizeof(*jobs) * jobs_cap));
+	}
+	job = &jobs[njobs++];
+	job->pgid = pgid;
+	job->pids = pids;
+	job->nprocs = nprocs;
+	job->status = 0;
+	job->name = job_name(cmds, nprocs);
+	for (job->nlive = i = 0; i < nprocs; i++)
+		if (pids[i] != -1)
+			job->nlive++;
+}
+
+static void remove_job(int i) {
+	free(jobs[i].pids);
+	free(jobs[i].name);
+	memmove(&jobs[i], &jobs[i + 1], sizeof(*jobs) * (njobs - i - 1));
+	njobs--;
+}
+
+static int running_jobs() {
+	int i, n = 0;
+	for (i = 0; i < njobs; i++)
+		if (jobs[i].nlive > 0)
+			n++;
+	return n;
+}
+
+/** Collects every child that has terminated, into the job table */
+static void reap_jobs() {
+	char buf[64];
+	pid_t pid;
+	int i, k, status;
+
+	while (read(chld_pipe[0], buf, sizeof(buf)) > 0)
+		;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0 || (pid == -1 && errno == EINTR)) {
+		if (pid == -1)
+			continue;
+		for (i = 0; i < njobs; i++)
+			for (k = 0; k < jobs[i].nprocs; k++)
+				if (jobs[i].pids[k] == pid) {
+					jobs[i].pids[k] = 0;
+					jobs[i].nlive--;
+					if (k == jobs[i].nprocs - 1)
+						jobs[i].status = status;
+				}
+	}
+}
+
+/** Blocks until a child terminates, or has done so since the last reap_jobs() */
+static void wait_child() {
+	struct pollfd pfd;
+
+	pfd.fd = chld_pipe[0];
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+		;
+}
+
+static void print_job(const struct job *job) {
+	const char *state = "Running";
+	char buf[32];
+
+	if (job->nlive == 0) {
+		if (WIFSIGNALED(job->status))
+			sprintf(buf, "Signal %d", WTERMSIG(job->status));
+		else if (WEXITSTATUS(job->status) != 0)
+			sprintf(buf, "Exit %d", WEXITSTATUS(job->status));
+		else
+			strcpy(buf, "Done");
+		state = buf;
+	}
+	fprintf(stdout, "[%lu] %-10s %s\n", (unsigned long)job->pgid, state, job->name);
+}
+
+/** Reports the finished jobs, and forgets them */
+static void notify_jobs() {
+	int i;
+
+	reap_jobs();
+	for (i = 0; i < njobs; )
+		if (jobs[i].nlive == 0) {
+			print_job(&jobs[i]);
+			remove_job(i);
+		} else
+			i++;
+}
+
+/** jobs: list the detached jobs */
+static int builtin_jobs(int argc, char * const *argv) {
+	int i;
+
+	if (argc > 1) {
+		fprintf(stderr, "Usage: %s\n", argv[0]);
+		return 2;
+	}
+	reap_jobs();
+	for (i = 0; i < njobs; i++)
+		if (jobs[i].nlive > 0)
+			print_job(&jobs[i]);
+	notify_jobs();
+	return 0;
+}
+
+/** wait [PID...]: wait for the jobs of PIDs, or all, and forget them */
+static int builtin_wait(int argc, char * const *argv) {
+	int a, i, k, retv = 0;
+
+	if (argc == 1) {
+		for (reap_jobs(); running_jobs() > 0; reap_jobs())
+			wait_child();
+		while (njobs > 0)
+			remove_job(0);
+		return 0;
+	}
+	for (a = 1; a < argc; a++) {
+		char *end;
+		long pid = strtol(argv[a], &end, 10);
+
+		for (i = 0; *end == '\0' && pid > 0 && i < njobs; i++) {
+			for (k = 0; k < jobs[i].nprocs && jobs[i].pids[k] != pid; k++)
+				;
+			if (k < jobs[i].nprocs || jobs[i].pgid == pid)
+				break;
+		}
+		if (*end != '\0' || pid <= 0 || i == njobs) {
+			fprintf(stderr, "wait: %s: not a job of this shell\n", argv[a]);
+			retv = 127;
+			continue;
+		}
+		for (reap_jobs(); jobs[i].nlive > 0; reap_jobs())
+			wait_child();
+		retv = WIFSIGNALED(jobs[i].status) ? 128 + WTERMSIG(jobs[i].status)
+			: WEXITSTATUS(jobs[i].status);
+		remove_job(i);
+	}
+	return retv;
+}
+
+/**
+ *  Runs the pipeline CMDS, its stages connected by pipes and all running
+ *  concurrently.  A detached pipeline gets a process group of its own, a
+ *  foreground one stays in the shell's, which holds the terminal, and is
+ *  waited for */
+void do_exec(struct command *cmds, int ncmds, int is_detached) {
+	pid_t *pids, pgid = 0;
+	int i, fd_in = -1, fds[2];
+
+	for (i = 0; i < ncmds; i++)
+		if ((cmds[i].path = hash_lookup(cmds[i].argv[0])) == NULL) {
+			fprintf(stderr, "%s: not found\n", cmds[i].argv[0]);
+			return;
+		}
+	assert(pids = (pid_t*)malloc(sizeof(pid_t) * ncmds));
+	fflush(stdout);
+
+	for (i = 0; i < ncmds; i++) {
+		fds[0] = fds[1] = -1;
+		if (i < ncmds - 1 && make_pipe(fds) == -1) {
+			fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+			ncmds = i;
+			break;
+		}
+		if ((pids[i] = start_stage(&cmds[i], fd_in, fds[1], is_detached, pgid)) != -1 && pgid == 0)
+			pgid = pids[i];
+		if (fd_in != -1)
+			close(fd_in);
+		if (fds[1] != -1)
+			close(fds[1]);
+		fd_in = fds[0];
+	}
+	if (fd_in != -1)
+		close(fd_in);
+
+	if (is_detached) {
+		if (pgid != 0) {
+			fprintf(stdout, "[%u] %s &\n", (unsigned)pgid, cmds[0].argv[0]);
+			add_job(pgid, pids, ncmds, cmds);
 			return;
-		} else {
-			int status;
-			waitpid(pid, &status, 0);
 		}
+	} else for (i = 0; i < ncmds; i++) {
+		int status;
+		if (pids[i] == -1)
+			continue;
+		while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR)
+			;
+		/* a forked command whose exec failed */
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 127 && cmds[i].path != cmds[i].argv[0])
+			hash_forget(cmds[i].argv[0]);
 	}
+	free(pids);
 }
 
-int main() {
+/*
+ *  In-process builtins: the main()s of these utilities are linked into the
+ *  shell with main renamed and exit() turned into builtin_exit() (see the
+ *  Makefile), and reset their static state on entry.  A simple foreground
+ *  command naming one runs in the shell process, unless its stdin is
+ *  redirected: the shell reads its own input through the same stdio
+ *  stream.  sh -E, or a command name with a slash, runs the binaries.
+ *
+ *  The shell ignores SIGINT and SIGQUIT, and a builtin can't safely be
+ *  unwound from a signal handler (cat and rm run threads, and any of them
+ *  may be inside malloc), so what could block or run long is left to the
+ *  binaries, where ^C works: cat of anything but a few small regular
+ *  files, rm -r or prompting, mv -i or --from0, and mv across devices.
+ */
+int cat_main(int, char **);
+int ln_main(int, char **);
+int mkdir_main(int, char **);
+int mv_main(int, char **);
+int rm_main(int, char **);
+int uname_main(int, char **);
+
+#define	BUILTIN_CAT_MAX	(1 << 20)	/* bytes cat may copy in-process */
+
+/** Whether option ARG, short or long, is one of SHORTS or starts LONGOPT */
+static int is_opt(const char *arg, const char *shorts, const char *longopt) {
+	if (arg[0] != '-' || arg[1] == '\0')
+		return 0;
+	if (arg[1] == '-')
+		return longopt && arg[2] && strncmp(arg + 2, longopt, strlen(arg + 2)) == 0;
+	return strpbrk(arg + 1, shorts) != NULL;
+}
+
+/* the operands of ARGV, after "--" or not starting with '-' */
+#define	FOR_OPERANDS(i, argc, argv, dashdash) \
+	for (i = 1, dashdash = 0; i < argc; i++) \
+		if (!dashdash && strcmp(argv[i], "--") == 0) \
+			dashdash = 1; \
+		else if (dashdash || argv[i][0] != '-' || argv[i][1] == '\0')
+
+static int cat_is_quick(int argc, char **argv) {
+	struct stat sbuf;
+	off_t total = 0;
+	int i, dd, nops = 0;
+
+	FOR_OPERANDS(i, argc, argv, dd) {
+		if (strcmp(argv[i], "-") == 0 || stat(argv[i], &sbuf) == -1)
+			return 0;
+		if (!S_ISREG(sbuf.st_mode) || (total += sbuf.st_size) > BUILTIN_CAT_MAX)
+			return 0;
+		nops++;
+	}
+	return nops > 0;	/* none is stdin */
+}
+
+/* neither recursive nor prompting, which rm does on a terminal unless -f */
+static int rm_is_quick(int argc, char **argv) {
+	int i, prompt = isatty(STDIN_FILENO);
+	const char *p;
+
+	for (i = 1; i < argc && strcmp(argv[i], "--"); i++) {
+		if (argv[i][0] != '-' || argv[i][1] == '-')
+			continue;
+		for (p = argv[i] + 1; *p; p++)
+			if (*p == 'r' || *p == 'R')
+				return 0;
+			else if (*p == 'i' || *p == 'f')
+				prompt = *p == 'i';
+	}
+	return !prompt;
+}
+
+static int mv_is_quick(int argc, char **argv) {
+	struct stat sbuf;
+	dev_t dev;
+	const char *target = NULL;
+	char *dir, *slash;
+	int i, dd, quick = 1;
+
+	for (i = 1; i < argc && strcmp(argv[i], "--"); i++)
+		if (is_opt(argv[i], "i", "from0"))
+			return 0;
+	FOR_OPERANDS(i, argc, argv, dd)
+		target = argv[i];
+	if (target == NULL)
+		return 1;
+	/* the device of TARGET if a directory, of its parent otherwise */
+	if (stat(target, &sbuf) == -1 || !S_ISDIR(sbuf.st_mode)) {
+		assert(dir = malloc(strlen(target) + 2));
+		strcpy(dir, target);
+		if ((slash = strrchr(dir, '/')) == NULL)
+			strcpy(dir, ".");
+		else
+			slash[slash == dir] = '\0';
+		i = stat(dir, &sbuf);
+		free(dir);
+		if (i == -1)
+			return 1;
+	}
+	dev = sbuf.st_dev;
+	FOR_OPERANDS(i, argc, argv, dd)
+		if (argv[i] != target && lstat(argv[i], &sbuf) == 0 && sbuf.st_dev != dev)
+			quick = 0;
+	return quick;
+}
+
+static const struct builtin {
+	const char *name;
+	int (*main)(int, char **);
+	int (*is_quick)(int, char **);	/* NULL if always */
+} builtins[] = {
+	{ "cat", cat_main, cat_is_quick },
+	{ "ln", ln_main, NULL },
+	{ "mkdir", mkdir_main, NULL },
+	{ "mv", mv_main, mv_is_quick },
+	{ "rm", rm_main, rm_is_quick },
+	{ "uname", uname_main, NULL },
+	{ NULL, NULL, NULL }
+};
+
+static int use_builtins = 1;
+static int in_builtin = 0;
+static pid_t shell_pid;
+static jmp_buf builtin_env;
+
+/** The builtin to run CMD in-process with, NULL to run it externally */
+static const struct builtin *find_builtin(const struct command *cmd) {
+	const struct builtin *b;
+	for (b = builtins; use_builtins && b->name; b++)
+		if (strcmp(b->name, cmd->argv[0]) == 0)
+			return !b->is_quick || b->is_quick(cmd->argc, cmd->argv) ? b : NULL;
+	return NULL;
+}
+
+/** exit() of the builtins: back to run_builtin(), unless in a forked child */
+void builtin_exit(int status) {
+	if (!in_builtin || getpid() != shell_pid)
+		exit(status);
+	longjmp(builtin_env, (status & 0xff) + 1);
+}
+
+/** Runs CMD through builtin B, its output redirected for the duration */
+static int run_builtin(const struct builtin *b, struct command *cmd) {
+	int rd_in, rd_out, saved_out = -1, status;
+
+	if (open_redirections(cmd, &rd_in, &rd_out) == -1)
+		return EXIT_FAILURE;
+	fflush(stdout);
+	if (rd_out != -1) {
+		saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+		dup2(rd_out, STDOUT_FILENO);
+		close(rd_out);
+	}
+
+	/* getopt() starts over */
+#if defined __GLIBC__
+	optind = 0;
+#else
+	optind = 1;
+#endif
+	in_builtin = 1;
+	if ((status = setjmp(builtin_env)) == 0)
+		status = b->main(cmd->argc, cmd->argv);
+	else
+		status--;
+	in_builtin = 0;
+
+	fflush(stdout);
+	clearerr(stdin);
+	if (saved_out != -1) {
+		dup2(saved_out, STDOUT_FILENO);
+		close(saved_out);
+	}
+	return status;
+}
+
+int main(int argc, char *argv[]) {
 	char *line = NULL;
 	size_t n = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "Ej:")) != -1) {
+		switch (opt) {
+		case 'E': use_builtins = 0; break;
+		case 'j':
+			if ((max_jobs = atoi(optarg)) > 0)
+				break;
+			/* FALLTHRU */
+		default:
+			fprintf(stderr, "Usage: %s [-E] [-j JOBS]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	shell_pid = getpid();
 
 	PS1 = getenv("PS1") ? getenv("PS1") : "$ ";
 
 	signal(SIGINT, SIG_IGN);
 	signal(SIGQUIT, SIG_IGN);
+	/* No job control, commands inherit this */
+	signal(SIGTSTP, SIG_IGN);
+	init_jobs();
 
 	for(prompt(), errno = 0; getline(&line, &n, stdin) != -1; prompt(), errno = 0) {
-		int newargc = 1;
-		char **newargv = (char**)malloc(sizeof(char*) * newargc);
-		char *tok = NULL, *newline = cleanup_line(line);
-		int detached_exec = 0;
-
-		while (tok = strtok(tok ? NULL : newline, " \t")) {
-			++newargc;
-			assert(newargv = (char**)realloc(newargv, sizeof(char*) * newargc));
-			newargv[newargc - 2] = strdup(tok);
-		}
-
-		newargv[newargc-1] = NULL;
+		struct command *cmds;
+		const struct builtin *b;
+		int detached_exec, ncmds = parse_line(line, &cmds, &detached_exec);
 
-		/* Background process? (cmd ~ /.* &$/) */
-		if (newargc > 1 && !strcmp(newargv[newargc-2], "&")) {
-			detached_exec = 1;
-			free(newargv[--newargc]);
-			newargv[newargc-1] = NULL;
+		if (ncmds == 1 && !strcmp(cmds[0].argv[0], "hash")) {
+			builtin_hash(cmds[0].argc, cmds[0].argv);
+		} else if (ncmds == 1 && !strcmp(cmds[0].argv[0], "jobs")) {
+			builtin_jobs(cmds[0].argc, cmds[0].argv);
+		} else if (ncmds == 1 && !strcmp(cmds[0].argv[0], "wait")) {
+			builtin_wait(cmds[0].argc, cmds[0].argv);
+		} else if (ncmds == 1 && !detached_exec && !cmds[0].in && (b = find_builtin(&cmds[0]))) {
+			run_builtin(b, &cmds[0]);
+		} else if (ncmds > 0) {
+			/* -j: hold a detached job back until one of the running ends */
+			for (reap_jobs(); detached_exec && max_jobs > 0 && running_jobs() >= max_jobs; reap_jobs())
+				wait_child();
+			do_exec(cmds, ncmds, detached_exec);
 		}
+		if (ncmds > 0)
+			free_commands(cmds, ncmds);
 
-		if (newargc > 1) {
-			do_exec(newargc, newargv, detached_exec);
-		}
-
-		/* free strdup'd argv elements and argv itself */
-		while (newargc > 1) {
-			free(newargv[newargc-1]);
-			newargc--;
-		}
-		free(newargv);
-		free(newline);
-
-		/* Check for any changes with spawned detached 'jobs' */
-		do {
-			int status;
-			pid_t pid = waitpid(-1, &status, WNOHANG);
-			if (pid == -1 && errno != ECHILD) {
-				fprintf(stderr, "waitpid(-1,...) failed: %s\n", strerror(errno));
-			} else if (pid > 0) {
-				fprintf(stdout, "[%lu]: terminated, status: %i\n", (unsigned long)pid, status);
-			}
-		} while(0);
+		notify_jobs();
 	}
 
 	if (errno != 0) {
@@ -8,19 +8,63 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <libgen.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#if defined __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#endif
 
 
+/* a tail'ed file, and its follow (-f/-F) state */
+struct tail_file {
+	char *name;		/* operand */
+	const char *base;	/* -F: name within its directory */
+	int fd;			/* -1 when not (yet, -F) followed */
+	off_t pos;		/* offset up to which output was made */
+	dev_t dev;
+	ino_t ino;
+	int wd, dir_wd;		/* inotify watches, on file and directory (-F) */
+};
+
+/* follow modes */
+enum { FOLLOW_NONE = 0, FOLLOW_DESCRIPTOR, FOLLOW_NAME };
+
 static struct {
 	char *exename,
 	     *usage_str;
-	int opt_n;
-	char **linebuf;
-	size_t nlines;
+	int opt_n,
+	    opt_f,	/* -f/-F: follow mode */
+	    opt_c,	/* -c: count bytes rather than lines */
+	    opt_plus;	/* +N: count from the start of the input */
+	off_t opt_nbytes;
+
+	struct tail_file *files;
+	size_t nfiles,
+	       last;	/* file of the latest output, for headers */
+	char *iobuf;
+	int inotify_fd;
+
+	/* retained input, bytes [base, end) of the stream are stored in the
+	 * circular buffer ring[cap] at their offset modulo cap */
+	char *ring;
+	size_t cap;
+	off_t base, end;
+
+	/* circular index of the start offsets of the last (up to opt_n)
+	 * complete lines, and start of the line being read */
+	off_t *lines;
+	size_t first, nlines;
+	off_t cur;
 } _g;
 
+/* read(2) chunk size, also the initial ring buffer capacity */
+#define	TAIL_BUFSIZ	(64*1024)
+
 
 /**
  *  formats error message and append strerror(errno) */
@@ -48,91 +92,531 @@ static int usage(char *msg, ...)
 	return EXIT_FAILURE;
 }
 
+static void follow_watch(struct tail_file *tf);
+static void follow_unwatch(struct tail_file *tf);
+
+/* write(2) all of BUF, retrying short writes */
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
 /**
- *  Append the (non-statically stored) line to the buffer
- *  shifting pointers and allocating memory when necessary */
-void linebuf_add(char *line)
+ *  Make room for LEN more bytes, doubling the ring and re-laying out the
+ *  retained bytes at their new offset modulo the capacity */
+static void ring_reserve(size_t len)
 {
-	assert(_g.linebuf != NULL);
-	if (_g.nlines < _g.opt_n) {
-		_g.linebuf[_g.nlines++] = line;
-	} else {
-		size_t i;
-		free(_g.linebuf[0]);
-		for (i=0; i<_g.opt_n-1; i++)
-			_g.linebuf[i] = _g.linebuf[i+1];
-		_g.linebuf[_g.opt_n-1] = line;
+	size_t used = _g.end - _g.base, newcap;
+	char *newring;
+	off_t off;
+
+	if (used + len <= _g.cap)
+		return;
+	for (newcap = _g.cap ? _g.cap : TAIL_BUFSIZ; newcap < used + len; newcap *= 2)
+		;
+	assert(newring = malloc(newcap));
+	for (off = _g.base; off < _g.end; ) {
+		size_t from = off % _g.cap, to = off % newcap, n = _g.end - off;
+		if (n > _g.cap - from)
+			n = _g.cap - from;
+		if (n > newcap - to)
+			n = newcap - to;
+		memcpy(newring+to, _g.ring+from, n);
+		off += n;
 	}
+	free(_g.ring);
+	_g.ring = newring;
+	_g.cap = newcap;
 }
 
-void dump_linebuf()
+static void ring_append(const char *p, size_t len)
 {
-	char **p = _g.linebuf;
-	assert(_g.linebuf != NULL);
-	while (p < _g.linebuf+_g.nlines)
-		printf("%s", *(p++));
+	ring_reserve(len);
+	while (len > 0) {
+		size_t at = _g.end % _g.cap, n = _g.cap - at;
+		if (n > len)
+			n = len;
+		memcpy(_g.ring+at, p, n);
+		_g.end += n;
+		p += n;
+		len -= n;
+	}
 }
 
-int do_tail(const char *filename)
+/**
+ *  The line at _g.cur is complete: index it, forgetting the oldest
+ *  line (and releasing its bytes) when opt_n lines are already retained */
+static void line_complete(void)
 {
-	FILE *in;
-	ssize_t n, nread;
+	if (_g.nlines == _g.opt_n) {
+		_g.first = (_g.first+1) % _g.opt_n;
+		_g.nlines--;
+	}
+	_g.lines[(_g.first + _g.nlines++) % _g.opt_n] = _g.cur;
+	_g.base = _g.lines[_g.first];
+	_g.cur = _g.end;
+}
 
-	if (filename == NULL || filename[0] == '-' && filename[1] == '\0') {
-		filename = "<stdin>";
-		in = stdin;
-	} else
-		if ((in = fopen(filename, "r")) == NULL)
-			return ERR("unable to open '%s' (input)", filename);
-
-	/* do_tail reuses the linebuffer across subsequent calls
-	 * and only resets the line index */
-	_g.nlines = 0;
-
-	do {
-		char *line = NULL;
-		if ( (nread = getline(&line, (size_t*)&n, in)) == -1 ) {
-			if (ferror(in))
-				ERR("error reading '%s'", filename);
-		} else
-			linebuf_add(line);
-	} while ( !(feof(in) || ferror(in)) );
+static int dump_ring(void)
+{
+	off_t off;
+	for (off = _g.base; off < _g.end; ) {
+		size_t at = off % _g.cap, n = _g.end - off;
+		if (n > _g.cap - at)
+			n = _g.cap - at;
+		if (write_all(STDOUT_FILENO, _g.ring+at, n) == -1)
+			return ERR("write error");
+		off += n;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ *  Regular files: scan backwards from EOF in TAIL_BUFSIZ pread(2) blocks,
+ *  counting newlines, and return the offset the last opt_n lines start at */
+static off_t lines_start(int fd, char *buf, off_t size)
+{
+	off_t pos = size;
+	size_t count = 0;
+	ssize_t n, i;
+
+	while (pos > 0) {
+		size_t len = pos < TAIL_BUFSIZ ? pos : TAIL_BUFSIZ;
+		pos -= len;
+		if ((n = pread(fd, buf, len, pos)) == -1 && errno == EINTR) {
+			pos += len;
+			continue;
+		} else if (n != len)
+			return -1;
+		for (i = len; i-- > 0; )
+			/* the final newline terminates rather than delimits a line */
+			if (buf[i] == '\n' && pos+i != size-1 && ++count == _g.opt_n)
+				return pos+i+1;
+	}
+	return 0;
+}
 
-	dump_linebuf();
+/* +N: offset of the start of line opt_n, scanning forward from offset 0 */
+static off_t lines_skip(int fd, char *buf, off_t size)
+{
+	off_t pos = 0;
+	size_t count = 1;
+	ssize_t n;
+	char *p, *nl;
+
+	while (pos < size && count < _g.opt_n) {
+		size_t len = size-pos < TAIL_BUFSIZ ? size-pos : TAIL_BUFSIZ;
+		if ((n = pread(fd, buf, len, pos)) == -1 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+			return -1;
+		for (p = buf; (nl = memchr(p, '\n', buf+n-p)) != NULL; p = nl+1)
+			if (++count == _g.opt_n)
+				return pos + (nl+1-buf);
+		pos += n;
+	}
+	return pos;
+}
+
+/* regular files: offset the output starts at */
+static off_t output_start(int fd, char *buf, off_t size)
+{
+	if (!_g.opt_c && !_g.opt_plus && _g.opt_n == 0)
+		return size;
+	else if (!_g.opt_c)
+		return _g.opt_plus ? lines_skip(fd, buf, size) : lines_start(fd, buf, size);
+	else if (_g.opt_plus)
+		return _g.opt_nbytes > size ? size : _g.opt_nbytes > 0 ? _g.opt_nbytes-1 : 0;
+	else
+		return _g.opt_nbytes > size ? 0 : size-_g.opt_nbytes;
+}
 
-	if (in != stdin)
-		fclose(in);
+/**
+ *  copy bytes [off, end) of FD to the standard output, in-kernel with
+ *  sendfile(2) unless the output doesn't allow it (e.g. O_APPEND) */
+static int copy_out(int fd, char *buf, off_t off, off_t end)
+{
+	ssize_t n;
+#if defined __linux__
+	while (off < end) {
+		if ((n = sendfile(STDOUT_FILENO, fd, &off, end-off)) > 0)
+			continue;
+		else if (n == -1 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		else if (n == 0)
+			return -1;
+		else if (errno == EINVAL || errno == ENOSYS)
+			break;
+		else
+			return -1;
+	}
+#endif
+	while (off < end) {
+		size_t len = end-off < TAIL_BUFSIZ ? end-off : TAIL_BUFSIZ;
+		if ((n = pread(fd, buf, len, off)) == -1 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+			return -1;
+		if (write_all(STDOUT_FILENO, buf, n) == -1)
+			return -1;
+		off += n;
+	}
 	return 0;
 }
 
+/**
+ *  Print the "==> NAME <==" header of file #I ahead of its output, when
+ *  tailing several files and its output isn't the latest one shown */
+static void show_header(size_t i)
+{
+	if (_g.nfiles < 2 || _g.last == i)
+		return;
+	printf("%s==> %s <==\n", _g.last == (size_t)-1 ? "" : "\n", _g.files[i].name);
+	fflush(stdout);
+	_g.last = i;
+}
+
+/**
+ *  Non-seekable input: retain the last lines (or bytes, -c) in the
+ *  ring buffer, output once EOF is reached */
+static int stream_tail(int fd, const char *filename, off_t *nread_total)
+{
+	char *buf = _g.iobuf;
+	ssize_t nread;
+	int retv = EXIT_SUCCESS;
+
+	/* do_tail reuses the ring buffer across subsequent calls
+	 * and only resets the offsets */
+	_g.base = _g.end = _g.cur = 0;
+	_g.first = _g.nlines = 0;
+
+	while ((nread = read(fd, buf, TAIL_BUFSIZ)) != 0) {
+		char *p, *q, *nl;
+		if (nread == -1 && errno == EINTR)
+			continue;
+		else if (nread == -1) {
+			retv = ERR("error reading '%s'", filename);
+			break;
+		}
+		if (!_g.opt_c && _g.opt_n == 0)
+			_g.base = _g.end = _g.cur += nread;	/* -n 0: nothing retained */
+		else if (_g.opt_c) {
+			ring_append(buf, nread);
+			if (_g.end - _g.base > _g.opt_nbytes)
+				_g.base = _g.end - _g.opt_nbytes;
+		} else for (p = buf; p < buf+nread; p = q) {
+			nl = memchr(p, '\n', buf+nread-p);
+			q = nl ? nl+1 : buf+nread;
+			ring_append(p, q-p);
+			if (nl)
+				line_complete();
+		}
+	}
+	/* unterminated last line */
+	if (!_g.opt_c && _g.opt_n > 0 && _g.end > _g.cur)
+		line_complete();
+
+	*nread_total = _g.end;
+	return retv | dump_ring();
+}
+
+/* Non-seekable input, +N: discard the head and pass the rest through */
+static int stream_skip(int fd, const char *filename, off_t *nread_total)
+{
+	char *buf = _g.iobuf, *p, *nl;
+	off_t skip = _g.opt_c ? _g.opt_nbytes-1 : _g.opt_n-1;
+	ssize_t nread;
+
+	for (*nread_total = 0; (nread = read(fd, buf, TAIL_BUFSIZ)) != 0; *nread_total += nread) {
+		if (nread == -1 && errno == EINTR) {
+			nread = 0;
+			continue;
+		} else if (nread == -1)
+			return ERR("error reading '%s'", filename);
+
+		p = buf;
+		if (skip > 0 && _g.opt_c) {
+			p += skip < nread ? skip : nread;
+			skip -= p-buf;
+		} else
+			while (skip > 0 && (nl = memchr(p, '\n', buf+nread-p)) != NULL) {
+				p = nl+1;
+				skip--;
+			}
+		if (skip > 0)
+			continue;
+		if (write_all(STDOUT_FILENO, p, buf+nread-p) == -1)
+			return ERR("write error");
+	}
+	return EXIT_SUCCESS;
+}
+
+int do_tail(size_t i)
+{
+	struct tail_file *tf = &_g.files[i];
+	const char *filename = tf->name;
+	struct stat sbuf;
+	off_t start;
+	char *buf = _g.iobuf;
+	int fd, retv = EXIT_SUCCESS;
+
+	if (filename[0] == '-' && filename[1] == '\0') {
+		filename = "<stdin>";
+		fd = STDIN_FILENO;
+	} else if ((fd = open(filename, O_RDONLY)) == -1)
+		return ERR("unable to open '%s' (input)", filename);
+
+	show_header(i);
+
+	/* seekable input: only the part to be output is ever read */
+	if (fstat(fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode) && sbuf.st_size > 0) {
+		if ((start = output_start(fd, buf, sbuf.st_size)) == -1
+			|| copy_out(fd, buf, start, sbuf.st_size) == -1)
+			retv = ERR("error reading '%s'", filename);
+		tf->pos = sbuf.st_size;
+	} else {
+		off_t nread_total = 0;
+		retv = _g.opt_plus ? stream_skip(fd, filename, &nread_total) : stream_tail(fd, filename, &nread_total);
+		if ((tf->pos = lseek(fd, 0, SEEK_CUR)) == -1)
+			tf->pos = nread_total;
+	}
+
+	/* only regular files are followed, pipes have been read up to EOF */
+	if (_g.opt_f && S_ISREG(sbuf.st_mode)) {
+		tf->fd = fd;
+		tf->dev = sbuf.st_dev;
+		tf->ino = sbuf.st_ino;
+	} else if (fd != STDIN_FILENO)
+		close(fd);
+	return retv;
+}
+
+/* output what was appended to (or written anew after truncation of) file #I */
+static int follow_check_fd(size_t i)
+{
+	struct tail_file *tf = &_g.files[i];
+	struct stat sbuf;
+
+	if (tf->fd == -1 || fstat(tf->fd, &sbuf) == -1)
+		return EXIT_SUCCESS;
+	if (sbuf.st_size < tf->pos) {
+		fprintf(stderr, "%s: '%s' has been truncated\n", _g.exename, tf->name);
+		tf->pos = 0;
+	}
+	if (sbuf.st_size > tf->pos) {
+		show_header(i);
+		if (copy_out(tf->fd, _g.iobuf, tf->pos, sbuf.st_size) == -1)
+			return ERR("error reading '%s'", tf->name);
+		tf->pos = sbuf.st_size;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ *  With -F the name of file #I is checked first: a file that was replaced
+ *  (rotated) is drained and the new one followed from its start, and a
+ *  missing one is waited for */
+static int follow_check(size_t i)
+{
+	struct tail_file *tf = &_g.files[i];
+	struct stat sbuf;
+	int fd, retv = EXIT_SUCCESS;
+
+	if (_g.opt_f == FOLLOW_NAME && tf->fd != STDIN_FILENO) {
+		int exists = stat(tf->name, &sbuf) == 0;
+		if (tf->fd != -1 && exists && sbuf.st_dev == tf->dev && sbuf.st_ino == tf->ino)
+			return follow_check_fd(i);
+
+		fd = exists ? open(tf->name, O_RDONLY) : -1;
+		if (tf->fd != -1) {
+			retv |= follow_check_fd(i);
+			follow_unwatch(tf);
+			close(tf->fd);
+			tf->fd = -1;
+			fprintf(stderr, "%s: '%s' has %s\n", _g.exename, tf->name,
+				fd == -1 ? "become inaccessible" : "been replaced; following new file");
+		} else if (fd != -1)
+			fprintf(stderr, "%s: '%s' has appeared; following new file\n", _g.exename, tf->name);
+
+		if (fd != -1 && fstat(fd, &sbuf) == 0) {
+			tf->fd = fd;
+			tf->pos = 0;
+			tf->dev = sbuf.st_dev;
+			tf->ino = sbuf.st_ino;
+			follow_watch(tf);
+		} else if (fd != -1)
+			close(fd);
+	}
+	return retv | follow_check_fd(i);
+}
+
+#if defined __linux__
+/* (re)register the inotify watch on the file, and with -F on its directory */
+static void follow_watch(struct tail_file *tf)
+{
+	const char *path = tf->fd == STDIN_FILENO ? "/dev/stdin" : tf->name;
+
+	if (tf->fd != -1)
+		tf->wd = inotify_add_watch(_g.inotify_fd, path,
+			IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+	if (_g.opt_f == FOLLOW_NAME && tf->dir_wd == -1 && tf->fd != STDIN_FILENO) {
+		char *dir = strdup(tf->name);
+		assert(dir != NULL);
+		tf->base = strrchr(tf->name, '/') ? strrchr(tf->name, '/')+1 : tf->name;
+		tf->dir_wd = inotify_add_watch(_g.inotify_fd, dirname(dir),
+			IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB);
+		free(dir);
+	}
+}
+
+/* drop the watch on the file given up, which would otherwise live on with it */
+static void follow_unwatch(struct tail_file *tf)
+{
+	if (tf->wd != -1)
+		inotify_rm_watch(_g.inotify_fd, tf->wd);
+	tf->wd = -1;
+}
+
+/**
+ *  inotify driven follow loop: epoll sleeps on the inotify descriptor and
+ *  each event only gets the file(s) it refers to checked */
+static int follow(void)
+{
+	struct epoll_event ev;
+	union {
+		struct inotify_event align;
+		char buf[4096];
+	} events;
+	int efd, retv = EXIT_SUCCESS;
+	size_t i;
+
+	if ((_g.inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) == -1)
+		return ERR("inotify_init1");
+	if ((efd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return ERR("epoll_create1");
+	ev.events = EPOLLIN;
+	ev.data.fd = _g.inotify_fd;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, _g.inotify_fd, &ev) == -1)
+		return ERR("epoll_ctl");
+
+	for (i = 0; i < _g.nfiles; i++)
+		follow_watch(&_g.files[i]);
+	/* catch up with whatever happened before the watches were in place */
+	for (i = 0; i < _g.nfiles; i++)
+		retv |= follow_check(i);
+
+	for (;;) {
+		ssize_t nread;
+		char *p;
+
+		if (epoll_wait(efd, &ev, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return ERR("epoll_wait");
+		}
+		while ((nread = read(_g.inotify_fd, events.buf, sizeof(events.buf))) > 0)
+			for (p = events.buf; p < events.buf+nread; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+				const struct inotify_event *ie = (const struct inotify_event*)p;
+				for (i = 0; i < _g.nfiles; i++) {
+					struct tail_file *tf = &_g.files[i];
+					if (ie->wd == tf->wd && tf->fd != -1
+						|| ie->wd == tf->dir_wd && ie->len > 0 && !strcmp(ie->name, tf->base))
+						retv |= follow_check(i);
+				}
+			}
+		if (nread == -1 && errno != EAGAIN && errno != EINTR)
+			return ERR("read inotify events");
+	}
+	return retv;
+}
+#else
+static void follow_watch(struct tail_file *tf)
+{
+}
+
+static void follow_unwatch(struct tail_file *tf)
+{
+}
+
+/* no file change notification: poll once a second */
+static int follow(void)
+{
+	size_t i;
+	for (;;) {
+		for (i = 0; i < _g.nfiles; i++)
+			follow_check(i);
+		sleep(1);
+	}
+	return EXIT_SUCCESS;
+}
+#endif
+
 int main(int argc, char *argv[])
 {
-	int opt, retv=EXIT_SUCCESS;
+	int opt, retv=EXIT_SUCCESS, nfollowed = 0;
+	size_t i;
 	
 	_g.exename = argv[0];
-	_g.usage_str = "[-n NUMBER] FILE...";
+	_g.usage_str = "[-f|-F] [-c [+]NUMBER | -n [+]NUMBER] FILE...";
 	_g.opt_n = 10;
-	while ((opt = getopt(argc, argv, "n:")) != -1) {
+	while ((opt = getopt(argc, argv, "fFc:n:")) != -1) {
+		char *endptr;
 		errno = 0;
 		switch (opt) {
-		case 'n': _g.opt_n = strtol(optarg, NULL, 0);
-			  if (_g.opt_n == 0 && (errno=EINVAL)==EINVAL )
-				  return ERR("invalid line number specifier '%s'", optarg);
+		case 'f': _g.opt_f = FOLLOW_DESCRIPTOR; break;
+		case 'F': _g.opt_f = FOLLOW_NAME; break;
+		case 'c':
+		case 'n':
+			  _g.opt_c = opt == 'c';
+			  _g.opt_plus = *optarg == '+';
+			  _g.opt_nbytes = strtol(optarg, &endptr, 0);
+			  if (_g.opt_nbytes < 0)
+				  _g.opt_nbytes = -_g.opt_nbytes;
+			  _g.opt_n = _g.opt_nbytes;
+			  if (errno || endptr == optarg || *endptr != '\0') {
+				  errno = EINVAL;
+				  return ERR("invalid %s number specifier '%s'", _g.opt_c ? "byte" : "line", optarg);
+			  }
 			  break;
 		default:
 			exit(usage(NULL));
 		}
 	}
 
-	assert(_g.linebuf = calloc(_g.opt_n, sizeof(char*)));
-	_g.nlines = 0;
+	if (!_g.opt_c && !_g.opt_plus && _g.opt_n > 0)
+		assert(_g.lines = calloc(_g.opt_n, sizeof(off_t)));
+	assert(_g.iobuf = malloc(TAIL_BUFSIZ));
 
-	if (argc-optind > 0)
-		while (optind < argc)
-			retv |= do_tail(argv[optind++]);
-	else
-		retv = do_tail("-");
+	if (argc-optind > 0) {
+		_g.nfiles = argc-optind;
+		assert(_g.files = calloc(_g.nfiles, sizeof(*_g.files)));
+		for (i = 0; i < _g.nfiles; i++)
+			_g.files[i].name = argv[optind+i];
+	} else {
+		static struct tail_file stdin_file = { "-" };
+		_g.files = &stdin_file;
+		_g.nfiles = 1;
+	}
+	_g.last = (size_t)-1;
+
+	for (i = 0; i < _g.nfiles; i++) {
+		_g.files[i].fd = _g.files[i].wd = _g.files[i].dir_wd = -1;
+		retv |= do_tail(i);
+		nfollowed += _g.files[i].fd != -1 || _g.opt_f == FOLLOW_NAME;
+	}
+
+	if (_g.opt_f && nfollowed > 0)
+		retv |= follow();
 
 	return retv;
 }
-
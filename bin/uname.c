@@ -19,7 +19,7 @@ static struct {
 } _g;
 
 
-void usage(char *msg, ...)
+static void usage(char *msg, ...)
 {
 	if (msg) {
 		va_list ap;
@@ -36,6 +36,7 @@ int main(int argc, char *argv[])
 	int opt, retv=EXIT_SUCCESS;
 	struct utsname utsn;
 	
+	memset(&_g, 0, sizeof(_g));
 	_g.exename = argv[0];
 	_g.usage_str = "[-amnrsv]";
 	while ((opt = getopt(argc, argv, "armnrsv")) != -1) {
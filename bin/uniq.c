@@ -1,13 +1,17 @@
 
 #define	_POSIX_SOURCE
 
+#include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -15,9 +19,36 @@
 static struct {
 	char *exename,
 	     *usage_str;
-	int opt_c;	/* output repeat count */
+	int opt_c,	/* output repeat count */
+	    opt_d,	/* output repeated lines only */
+	    opt_u,	/* output unique lines only */
+	    need_counts,	/* output waits for final counts (-c, -d, -u) */
+	    opt_all,	/* --all: global, order preserving dedupe */
+	    opt_exact;	/* --exact: recount the --top candidates */
+	size_t opt_f,	/* -f: fields skipped by comparisons */
+	       opt_s;	/* -s: characters skipped by comparisons */
+	size_t opt_top;	/* --top: N most frequent lines */
+	size_t mem_cap;	/* --mem: hash table memory cap */
+
+	int out_fd;
+	char *obuf;	/* output buffer */
+	size_t olen;
 } _g;
 
+#define	OUT_BUFSIZ	(256*1024)
+/* --all: default memory cap, arena chunk size */
+#define	MEM_CAP_DEFAULT	(256UL*1024*1024)
+#define	MEM_CAP_MIN	(64UL*1024)
+#define	ARENA_CHUNK	(1024*1024)
+/* --all: a table outgrowing the cap spills to NPARTS partitions,
+ * picked by PART_BITS of the hash from the top down at each level */
+#define	PART_BITS	4
+#define	NPARTS		(1 << PART_BITS)
+#define	MAX_DEPTH	((int)(sizeof(unsigned long)*CHAR_BIT/PART_BITS) - 2)
+/* --top=N: number of Space-Saving counters per reported line, and floor */
+#define	TOP_COUNTERS	8
+#define	TOP_MIN_COUNTERS	1024
+
 
 /**
  *  formats error message and append strerror(errno) */
@@ -45,56 +76,696 @@ static int usage(char *msg, ...)
 	return EXIT_FAILURE;
 }
 
+/* write(2) all of BUF, retrying short writes */
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int out_flush(void)
+{
+	if (_g.olen > 0 && write_all(_g.out_fd, _g.obuf, _g.olen) == -1)
+		return -1;
+	_g.olen = 0;
+	return 0;
+}
+
+/* buffered output, writes larger than the buffer go out directly */
+static int out_write(const char *p, size_t len)
+{
+	if (_g.olen + len > OUT_BUFSIZ && out_flush() == -1)
+		return -1;
+	if (len >= OUT_BUFSIZ)
+		return write_all(_g.out_fd, p, len);
+	memcpy(_g.obuf+_g.olen, p, len);
+	_g.olen += len;
+	return 0;
+}
+
+/* output LINE, preceded by its "%4lu " formatted repeat count with -c,
+ * unless filtered out by -d or -u */
+static int out_line(unsigned long count, const char *line, size_t len)
+{
+	if (_g.opt_d && count == 1 || _g.opt_u && count > 1)
+		return 0;
+	if (_g.opt_c) {
+		char buf[32], *p = buf+sizeof(buf);
+		*--p = ' ';
+		do
+			*--p = '0' + count % 10;
+		while ((count /= 10) > 0);
+		while (p > buf+sizeof(buf)-5)
+			*--p = ' ';
+		if (out_write(p, buf+sizeof(buf)-p) == -1)
+			return -1;
+	}
+	return out_write(line, len);
+}
+
+/* word-at-a-time: nonzero if a byte of W is zero, or a blank */
+#define	ONES		((unsigned long)-1 / 0xff)
+#define	HASZERO(w)	(((w) - ONES) & ~(w) & ONES*0x80)
+#define	HASBLANK(w)	(HASZERO((w) ^ ONES*' ') | HASZERO((w) ^ ONES*'\t'))
+
+/* first blank from P on, a word at a time */
+static const char *skip_nonblank(const char *p, const char *end)
+{
+	unsigned long w;
+	while ((size_t)(end - p) >= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		if (HASBLANK(w))
+			break;
+		p += sizeof(w);
+	}
+	while (p < end && *p != ' ' && *p != '\t')
+		p++;
+	return p;
+}
+
+/**
+ *  Offset of the comparison key of LINE: past -f fields (blanks followed
+ *  by non-blanks) and then -s characters, up to the newline */
+static size_t key_offset(const char *line, size_t len)
+{
+	const char *p = line, *end = line + len;
+	size_t f;
+
+	if (_g.opt_f == 0 && _g.opt_s == 0)
+		return 0;
+	if (len > 0 && end[-1] == '\n')
+		end--;
+	for (f = _g.opt_f; f > 0 && p < end; f--) {
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		p = skip_nonblank(p, end);
+	}
+	p = (size_t)(end - p) > _g.opt_s ? p + _g.opt_s : end;
+	return p - line;
+}
+
+/*
+ *  --all: lines are interned in a string arena and looked up through an
+ *  open addressing (linear probing) hash table, the entries are chained in
+ *  first occurrence order.
+ *
+ *  Once the table would outgrow _g.mem_cap, lines not already in the table
+ *  are spilled to NPARTS temporary partition files by hash and deduplicated
+ *  one partition at a time (recursively so), each to a result file.  The
+ *  first occurrence of a spilled line always follows those of all lines in
+ *  the table, so the output is the table followed by the result files
+ *  merged by input sequence number.
+ *
+ *  Lines are hashed and compared by their keys, starting KOFF bytes in.
+ */
+struct hentry {
+	unsigned long hash,
+		      seq,	/* input line # of the first occurrence */
+		      count;
+	size_t len, koff;
+	char *line;
+	struct hentry *next;	/* first occurrence order */
+};
+
+struct arena_chunk {
+	struct arena_chunk *next;
+};
+
+struct htable {
+	struct hentry **slots;
+	size_t nslots, nused;
+	struct hentry *first, *last;
+
+	struct arena_chunk *chunks;
+	char *aptr;		/* free space in the current chunk */
+	size_t aleft;
+	size_t mem;		/* bytes of slots and arena in use */
+};
+
+/* partition and result file record header, followed by LEN bytes */
+struct record {
+	unsigned long seq, count;
+	size_t len, koff;
+};
+
+/* input of a dedupe pass: lines of the input file or spilled records */
+struct source {
+	FILE *fp;
+	int is_records;
+	char *buf;
+	size_t bufsz;
+	unsigned long seq;
+};
+
+static unsigned long hash_line(const char *p, size_t len)
+{
+#if ULONG_MAX > 0xffffffffUL
+	unsigned long h = 14695981039346656037UL;	/* FNV-1a 64 */
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*p++) * 1099511628211UL;
+	return h ^ h >> 29;
+#else
+	unsigned long h = 2166136261UL;			/* FNV-1a 32 */
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*p++) * 16777619UL;
+	return h ^ h >> 15;
+#endif
+}
+
+/* bump allocation from the table's arena */
+static void *arena_alloc(struct htable *t, size_t size)
+{
+	void *p;
+	size = (size + sizeof(long)-1) & ~(sizeof(long)-1);
+	if (size > t->aleft) {
+		size_t chunk = size + sizeof(long) > ARENA_CHUNK ? size + sizeof(long) : ARENA_CHUNK;
+		struct arena_chunk *c = malloc(chunk);
+		assert(c != NULL);
+		c->next = t->chunks;
+		t->chunks = c;
+		t->aptr = (char*)c + sizeof(long);
+		t->aleft = chunk - sizeof(long);
+	}
+	t->mem += size;
+	p = t->aptr;
+	t->aptr += size;
+	t->aleft -= size;
+	return p;
+}
+
+/* slot holding a line keyed KEY, or the empty slot it would go to */
+static struct hentry **htable_find(struct htable *t, unsigned long hash, const char *key, size_t klen)
+{
+	size_t i = hash & (t->nslots-1);
+	struct hentry *e;
+	while ((e = t->slots[i]) != NULL) {
+		if (e->hash == hash && e->len - e->koff == klen && memcmp(e->line + e->koff, key, klen) == 0)
+			break;
+		i = (i+1) & (t->nslots-1);
+	}
+	return &t->slots[i];
+}
+
+static void htable_grow(struct htable *t)
+{
+	struct hentry **old = t->slots, *e;
+	size_t i, oldn = t->nslots;
+
+	t->nslots = oldn ? oldn*2 : 1024;
+	assert(t->slots = calloc(t->nslots, sizeof(*t->slots)));
+	t->mem += (t->nslots - oldn) * sizeof(*t->slots);
+	for (i = 0; i < oldn; i++)
+		if ((e = old[i]) != NULL)
+			*htable_find(t, e->hash, e->line + e->koff, e->len - e->koff) = e;
+	free(old);
+}
+
+/* memory an insertion of a LEN bytes line would take */
+static size_t htable_need(const struct htable *t, size_t len)
+{
+	size_t need = sizeof(struct hentry) + len + 2*sizeof(long);
+	if ((t->nused+1)*2 > t->nslots)
+		need += (t->nslots ? t->nslots : 1024) * sizeof(*t->slots);
+	return need;
+}
+
+static struct hentry *htable_insert(struct htable *t, unsigned long hash, const char *line, const struct record *rec)
+{
+	struct hentry *e, **slot;
+
+	if ((t->nused+1)*2 > t->nslots)
+		htable_grow(t);
+	slot = htable_find(t, hash, line + rec->koff, rec->len - rec->koff);
+	e = arena_alloc(t, sizeof(*e));
+	e->line = arena_alloc(t, rec->len);
+	memcpy(e->line, line, rec->len);
+	e->len = rec->len;
+	e->koff = rec->koff;
+	e->hash = hash;
+	e->seq = rec->seq;
+	e->count = rec->count;
+	e->next = NULL;
+	if (t->last)
+		t->last->next = e;
+	else
+		t->first = e;
+	t->last = e;
+	t->nused++;
+	return *slot = e;
+}
+
+static void htable_free(struct htable *t)
+{
+	struct arena_chunk *c, *next;
+	for (c = t->chunks; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+/* next input line or record, 0 at EOF, -1 on error */
+static int source_next(struct source *src, struct record *rec, char **line)
+{
+	if (!src->is_records) {
+		ssize_t len = getline(&src->buf, &src->bufsz, src->fp);
+		if (len == -1)
+			return ferror(src->fp) ? -1 : 0;
+		rec->seq = src->seq++;
+		rec->count = 1;
+		rec->len = len;
+		rec->koff = key_offset(src->buf, len);
+	} else {
+		if (fread(rec, sizeof(*rec), 1, src->fp) != 1)
+			return ferror(src->fp) ? -1 : 0;
+		if (rec->len > src->bufsz) {
+			src->bufsz = rec->len;
+			assert(src->buf = realloc(src->buf, src->bufsz));
+		}
+		if (fread(src->buf, 1, rec->len, src->fp) != rec->len)
+			return -1;
+	}
+	*line = src->buf;
+	return 1;
+}
+
+/* a deduplicated line goes to the output (SINK == NULL), or to a result file */
+static int emit(FILE *sink, unsigned long seq, unsigned long count, size_t koff, const char *line, size_t len)
+{
+	struct record rec;
+	if (sink == NULL)
+		return out_line(count, line, len);
+	rec.seq = seq;
+	rec.count = count;
+	rec.len = len;
+	rec.koff = koff;
+	if (fwrite(&rec, sizeof(rec), 1, sink) != 1 || fwrite(line, 1, len, sink) != len)
+		return -1;
+	return 0;
+}
+
+/* merge the result files of the (non-empty) partitions by sequence number */
+static int merge_results(FILE **results, FILE *sink)
+{
+	struct source heads[NPARTS];
+	struct record recs[NPARTS];
+	char *lines[NPARTS];
+	int i, min, live[NPARTS], retv = 0;
+
+	memset(heads, 0, sizeof(heads));
+	for (i = 0; i < NPARTS; i++) {
+		if ((live[i] = results[i] != NULL) == 0)
+			continue;
+		rewind(results[i]);
+		heads[i].fp = results[i];
+		heads[i].is_records = 1;
+		if ((live[i] = source_next(&heads[i], &recs[i], &lines[i])) == -1)
+			retv = -1;
+	}
+	while (retv == 0) {
+		for (min = -1, i = 0; i < NPARTS; i++)
+			if (live[i] > 0 && (min == -1 || recs[i].seq < recs[min].seq))
+				min = i;
+		if (min == -1)
+			break;
+		if (emit(sink, recs[min].seq, recs[min].count, recs[min].koff, lines[min], recs[min].len) == -1)
+			retv = -1;
+		else if ((live[min] = source_next(&heads[min], &recs[min], &lines[min])) == -1)
+			retv = -1;
+	}
+	for (i = 0; i < NPARTS; i++)
+		if (results[i] != NULL) {
+			free(heads[i].buf);
+			fclose(results[i]);
+		}
+	return retv;
+}
+
+/**
+ *  Deduplicate SRC into SINK, DEPTH being the partitioning level (0 for
+ *  the input itself).  Returns -1 on (temporary file) I/O errors */
+static int dedupe(struct source *src, FILE *sink, int depth)
+{
+	struct htable t;
+	struct hentry **slot, *e;
+	struct record rec;
+	FILE *parts[NPARTS], *results[NPARTS];
+	char *line;
+	int i, rc, spilled = 0, retv = 0;
+
+	memset(&t, 0, sizeof(t));
+	htable_grow(&t);
+
+	while (retv == 0 && (rc = source_next(src, &rec, &line)) > 0) {
+		unsigned long hash = hash_line(line + rec.koff, rec.len - rec.koff);
+		if (*(slot = htable_find(&t, hash, line + rec.koff, rec.len - rec.koff)) != NULL) {
+			(*slot)->count += rec.count;
+			continue;
+		}
+		if (!spilled && depth < MAX_DEPTH && t.nused > 0 && t.mem + htable_need(&t, rec.len) > _g.mem_cap) {
+			memset(parts, 0, sizeof(parts));
+			spilled = 1;
+		}
+		if (spilled) {
+			FILE **part = &parts[hash >> (sizeof(hash)*CHAR_BIT - PART_BITS*(depth+1)) & (NPARTS-1)];
+			if (*part == NULL && (*part = tmpfile()) == NULL) {
+				ERR("unable to create partition file");
+				retv = -1;
+			} else if (fwrite(&rec, sizeof(rec), 1, *part) != 1 || fwrite(line, 1, rec.len, *part) != rec.len)
+				retv = -1;
+			continue;
+		}
+		e = htable_insert(&t, hash, line, &rec);
+		if (!_g.need_counts && emit(sink, e->seq, e->count, e->koff, e->line, e->len) == -1)
+			retv = -1;
+	}
+	if (rc == -1)
+		retv = -1;
+
+	if (_g.need_counts)
+		for (e = t.first; retv == 0 && e; e = e->next)
+			if (emit(sink, e->seq, e->count, e->koff, e->line, e->len) == -1)
+				retv = -1;
+	htable_free(&t);
+
+	if (spilled) {
+		for (i = 0; i < NPARTS; i++) {
+			struct source part;
+			results[i] = NULL;
+			if (parts[i] == NULL)
+				continue;
+			memset(&part, 0, sizeof(part));
+			part.fp = parts[i];
+			part.is_records = 1;
+			rewind(parts[i]);
+			if ((results[i] = tmpfile()) == NULL)
+				retv = -1;
+			else if (retv == 0 && dedupe(&part, results[i], depth+1) == -1)
+				retv = -1;
+			free(part.buf);
+			fclose(parts[i]);
+		}
+		if (retv == 0)
+			retv = merge_results(results, sink);
+	}
+	return retv;
+}
+
+/*
+ *  --top=N: Space-Saving heavy hitters.  A fixed number of counters monitor
+ *  lines, looked up through a fixed size hash table and kept in a min-heap
+ *  on their counts.  An unmonitored line takes over the counter of the
+ *  least frequent one, inheriting its count as overestimation bound, so
+ *  memory depends on N only and any line more frequent than 1/counters of
+ *  the input is sure to be monitored.  With --exact the input is read a second
+ *  time to count the monitored lines exactly.
+ */
+struct topentry {
+	struct hentry e;	/* first: referred to as hentry by the table */
+	unsigned long err;	/* e.count overestimation bound */
+	size_t heapidx, bufsz;
+};
+
+/* remove E from the table, backward shifting its probe sequence */
+static void htable_remove(struct htable *t, struct hentry *e)
+{
+	size_t mask = t->nslots-1, i, j, home;
+
+	i = j = htable_find(t, e->hash, e->line + e->koff, e->len - e->koff) - t->slots;
+	t->slots[i] = NULL;
+	for (;;) {
+		j = (j+1) & mask;
+		if (t->slots[j] == NULL)
+			break;
+		home = t->slots[j]->hash & mask;
+		/* stays put if its home slot lies cyclically within (i, j] */
+		if (i <= j ? i < home && home <= j : i < home || home <= j)
+			continue;
+		t->slots[i] = t->slots[j];
+		t->slots[j] = NULL;
+		i = j;
+	}
+	t->nused--;
+}
+
+static void heap_swap(struct topentry **heap, size_t i, size_t j)
+{
+	struct topentry *te = heap[i];
+	heap[i] = heap[j];
+	heap[j] = te;
+	heap[i]->heapidx = i;
+	heap[j]->heapidx = j;
+}
+
+static void heap_up(struct topentry **heap, size_t i)
+{
+	while (i > 0 && heap[(i-1)/2]->e.count > heap[i]->e.count) {
+		heap_swap(heap, i, (i-1)/2);
+		i = (i-1)/2;
+	}
+}
+
+static void heap_down(struct topentry **heap, size_t n, size_t i)
+{
+	for (;;) {
+		size_t l = 2*i+1, r = l+1, min = i;
+		if (l < n && heap[l]->e.count < heap[min]->e.count)
+			min = l;
+		if (r < n && heap[r]->e.count < heap[min]->e.count)
+			min = r;
+		if (min == i)
+			break;
+		heap_swap(heap, i, min);
+		i = min;
+	}
+}
+
+/* most frequent first, ties in first occurrence order */
+static int top_cmp(const void *p1, const void *p2)
+{
+	const struct topentry *te1 = *(struct topentry * const *)p1, *te2 = *(struct topentry * const *)p2;
+	if (te1->e.count != te2->e.count)
+		return te1->e.count < te2->e.count ? 1 : -1;
+	return te1->e.seq < te2->e.seq ? -1 : te1->e.seq > te2->e.seq;
+}
+
+static int do_top(FILE *in)
+{
+	struct htable t;
+	struct topentry *entries, **heap, *te;
+	struct hentry **slot;
+	struct source src;
+	struct record rec;
+	char *line;
+	size_t i, n = 0, m = _g.opt_top * TOP_COUNTERS;
+	int rc;
+
+	if (m < TOP_MIN_COUNTERS)
+		m = TOP_MIN_COUNTERS;
+
+	memset(&t, 0, sizeof(t));
+	for (t.nslots = 16; t.nslots < 2*m; t.nslots *= 2)
+		;
+	assert(t.slots = calloc(t.nslots, sizeof(*t.slots)));
+	assert(entries = calloc(m, sizeof(*entries)));
+	assert(heap = calloc(m, sizeof(*heap)));
+	memset(&src, 0, sizeof(src));
+	src.fp = in;
+
+	while ((rc = source_next(&src, &rec, &line)) > 0) {
+		unsigned long hash = hash_line(line + rec.koff, rec.len - rec.koff);
+		if (*(slot = htable_find(&t, hash, line + rec.koff, rec.len - rec.koff)) != NULL) {
+			te = (struct topentry*)*slot;
+			te->e.count++;
+			heap_down(heap, n, te->heapidx);
+			continue;
+		}
+		if (n < m) {
+			te = heap[n] = &entries[n];
+			te->heapidx = n++;
+			te->e.count = te->err = 0;
+		} else {
+			/* evict the least frequent line */
+			te = heap[0];
+			htable_remove(&t, &te->e);
+			slot = htable_find(&t, hash, line + rec.koff, rec.len - rec.koff);
+			te->err = te->e.count;
+		}
+		if (rec.len > te->bufsz) {
+			te->bufsz = rec.len;
+			assert(te->e.line = realloc(te->e.line, te->bufsz));
+		}
+		memcpy(te->e.line, line, rec.len);
+		te->e.len = rec.len;
+		te->e.koff = rec.koff;
+		te->e.hash = hash;
+		te->e.seq = rec.seq;
+		te->e.count++;
+		*slot = &te->e;
+		t.nused++;
+		if (te->err == 0 && te->e.count == 1)
+			heap_up(heap, te->heapidx);
+		else
+			heap_down(heap, n, te->heapidx);
+	}
+	if (rc == -1)
+		return -1;
+
+	if (_g.opt_exact) {
+		rewind(in);
+		for (i = 0; i < n; i++)
+			entries[i].e.count = 0;
+		while ((rc = source_next(&src, &rec, &line)) > 0) {
+			const char *key = line + rec.koff;
+			size_t klen = rec.len - rec.koff;
+			if (*(slot = htable_find(&t, hash_line(key, klen), key, klen)) != NULL)
+				(*slot)->count++;
+		}
+		if (rc == -1)
+			return -1;
+	}
+
+	qsort(heap, n, sizeof(*heap), top_cmp);
+	for (i = 0; i < n && i < _g.opt_top; i++)
+		if (out_line(heap[i]->e.count, heap[i]->e.line, heap[i]->e.len) == -1)
+			return -1;
+
+	for (i = 0; i < n; i++)
+		free(entries[i].e.line);
+	free(entries);
+	free(heap);
+	free(t.slots);
+	free(src.buf);
+	return 0;
+}
+
+/* SIZE[KMG] */
+static size_t parse_size(const char *str)
+{
+	char *endptr;
+	unsigned long size = strtoul(str, &endptr, 10);
+	switch (*endptr) {
+	case 'g': case 'G': size *= 1024;	/* FALLTHROUGH */
+	case 'm': case 'M': size *= 1024;	/* FALLTHROUGH */
+	case 'k': case 'K': size *= 1024; endptr++;
+	}
+	return *endptr == '\0' && endptr != str ? size : 0;
+}
+
 int main(int argc, char *argv[])
 {
+	static struct option longopts[] = {
+		{ "all", no_argument, NULL, 'a' },
+		{ "mem", required_argument, NULL, 'm' },
+		{ "top", required_argument, NULL, 't' },
+		{ "exact", no_argument, NULL, 'e' },
+		{ NULL, 0, NULL, 0 }
+	};
 	int opt, retv=EXIT_SUCCESS;
-	FILE *in = stdin, *out = stdout;
-	char *line = NULL, *lastline = NULL;
-	size_t n = 0, rep_count;
-	
+	FILE *in = stdin;
+	/* the current and previous lines, their buffers swap roles
+	 * whenever a new line differs from the previous one */
+	char *line = NULL, *lastline = NULL, *tmp;
+	size_t n = 0, lastn = 0, tmpn, rep_count = 0, off, lastoff = 0;
+	char *endptr;
+	ssize_t len, lastlen = -1;
+
+
 	_g.exename = argv[0];
-	_g.usage_str = "[-c] [INFILE [OUTFILE]]";
-	while ((opt = getopt(argc, argv, "c")) != -1) {
+	_g.usage_str = "[-c|-d|-u] [-f FIELDS] [-s CHARS] [--all [--mem=SIZE[KMG]] | --top=N [--exact]] [INFILE [OUTFILE]]";
+	_g.mem_cap = MEM_CAP_DEFAULT;
+	while ((opt = getopt_long(argc, argv, "cduf:s:", longopts, NULL)) != -1) {
 		switch (opt) {
 		case 'c': _g.opt_c = 1; break;
+		case 'd': _g.opt_d = 1; break;
+		case 'u': _g.opt_u = 1; break;
+		case 'f':
+		case 's':
+			*(opt == 'f' ? &_g.opt_f : &_g.opt_s) = strtoul(optarg, &endptr, 10);
+			if (*optarg == '-' || *optarg == '\0' || *endptr != '\0')
+				exit(usage("invalid number of %s to skip '%s'\n",
+						opt == 'f' ? "fields" : "characters", optarg));
+			break;
+		case 'a': _g.opt_all = 1; break;
+		case 'm':
+			if ((_g.mem_cap = parse_size(optarg)) < MEM_CAP_MIN)
+				exit(usage("invalid memory size '%s'\n", optarg));
+			break;
+		case 't':
+			if ((_g.opt_top = strtoul(optarg, &endptr, 10)) == 0 || *endptr != '\0'
+					|| _g.opt_top > (size_t)-1 / (2*TOP_COUNTERS*sizeof(void*)))
+				exit(usage("invalid line count '%s'\n", optarg));
+			break;
+		case 'e': _g.opt_exact = 1; break;
 		default:
 			exit(usage(NULL));
 		}
 	}
+	_g.need_counts = _g.opt_c || _g.opt_d || _g.opt_u;
 
+	_g.out_fd = STDOUT_FILENO;
 	if (argc-optind > 0)
 		if ((in = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin) == NULL)
 			return ERR("error opening '%s' (input)", argv[optind]);
-	if (argc-optind > 1)
-		if ((out = strcmp(argv[optind+1], "-") ? fopen(argv[optind+1], "w") : stdout) == NULL)
+	if (argc-optind > 1 && strcmp(argv[optind+1], "-"))
+		if ((_g.out_fd = open(argv[optind+1], O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
 			return ERR("error opening '%s' (output)", argv[optind+1]);
+	assert(_g.obuf = malloc(OUT_BUFSIZ));
 
-	for (rep_count = 1; (opt = getline(&line, &n, in)) || 1!=0; ) {
-		/* Handle special cases of EOF and I/O error */
-		if (opt == -1 && feof(in)) {
-			if (_g.opt_c)
-				fprintf(out, "%4lu ", rep_count);
-			fprintf(out, "%s", line);
-			break;
-		} else if (opt == -1 && ferror(in))
-			return ERR("error reading '%s'", argv[optind]);
-
-		if (lastline != NULL) {
-			if (strcmp(lastline, line) != 0) {
-				if (_g.opt_c)
-					fprintf(out, "%4lu ", rep_count);
-				fprintf(out, "%s", lastline);
-				free(lastline);
-				lastline = strdup(line);
-				rep_count = 1;
-			} else {
-				rep_count++;
-				continue;
-			}
-		} else
-			lastline = strdup(line);
+	if (_g.opt_top) {
+		if (_g.opt_exact && lseek(fileno(in), 0, SEEK_CUR) == -1)
+			return ERR("--exact needs a seekable input");
+		/* the counts are the output */
+		_g.opt_c = 1;
+		if (do_top(in) == -1)
+			retv = ferror(in) ? ERR("error reading '%s'", argc-optind > 0 ? argv[optind] : "<stdin>")
+				: ERR("error writing output");
+		if (out_flush() == -1)
+			retv = ERR("error writing output");
+		return retv;
 	}
 
+	if (_g.opt_all) {
+		struct source src;
+		memset(&src, 0, sizeof(src));
+		src.fp = in;
+		if (dedupe(&src, NULL, 0) == -1)
+			retv = ferror(in) ? ERR("error reading '%s'", argc-optind > 0 ? argv[optind] : "<stdin>")
+				: ERR("error writing output");
+		if (out_flush() == -1)
+			retv = ERR("error writing output");
+		return retv;
+	}
+
+	while ((len = getline(&line, &n, in)) != -1) {
+		off = key_offset(line, len);
+		if (lastlen != -1 && len - off == lastlen - lastoff && memcmp(line + off, lastline + lastoff, len - off) == 0) {
+			rep_count++;
+			continue;
+		}
+		if (lastlen != -1 && out_line(rep_count, lastline, lastlen) == -1)
+			return ERR("error writing output");
+		tmp = lastline, lastline = line, line = tmp;
+		tmpn = lastn, lastn = n, n = tmpn;
+		lastlen = len;
+		lastoff = off;
+		rep_count = 1;
+	}
+	if (ferror(in))
+		retv = ERR("error reading '%s'", argc-optind > 0 ? argv[optind] : "<stdin>");
+
+	if (lastlen != -1 && out_line(rep_count, lastline, lastlen) == -1 || out_flush() == -1)
+		return ERR("error writing output");
+
 	return retv;
 }
-